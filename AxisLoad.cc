@@ -0,0 +1,616 @@
+/****************************************************************************\
+ *  AxisLoad                                                                *
+ *  A multi-camera load test for the CameraAxis and PtzAxis devices         *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  Starts N simulated cameras (axissim) and runs the camera and PTZ        *
+ *  devices of the drivers against them, as CameraAxis::Main() and         *
+ *  PtzAxis::Main() would, for N = 1, 2, 4, ... up to the maximum.          *
+ *  Reports per camera: frame throughput and latency, PTZ command and       *
+ *  query latency, and the CPU used by the drivers' side of the process.    *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "CameraAxisDevice.h"
+#include "PtzAxisDevice.h"
+#include "PtzAxisController.h"
+#include "PtzAxisGroup.h"
+
+using std::string;
+using std::vector;
+
+#define DEFAULT_PORT          8100
+#define DEFAULT_MAX_CAMERAS   8
+#define DEFAULT_SECONDS       5
+#define DEFAULT_FPS           25
+#define DEFAULT_PTZ_RATE      10       // PTZ commands per second and camera
+#define CONSUMER_SLEEP_USEC   1000     // Poll period of the frame consumer
+
+typedef struct _load_options {
+  string sim;              // Path of the simulator
+  int    max_cameras;      // Last step of the sweep
+  int    port;             // Port of the first simulated camera
+  int    seconds;          // Duration of each step
+  int    fps;              // Passed to the simulator
+  string resolution;       // Passed to the simulator
+  string sim_args;         // More simulator options: chunking, jitter, disconnects
+  int    ptz_rate;         // Commands per second per camera, 0: no PTZ load
+  int    burst;            // With -C: targets handed over back to back each time
+  bool   verbose;          // Print a row per camera
+  bool   controller;       // Track a moving target with PtzAxisController
+  int    group;            // Move all the cameras together: 0 no, GROUP_FANOUT or GROUP_SEQUENTIAL
+  bool   align;            // With GROUP_FANOUT: hold back the nearer cameras
+} load_options;
+
+static load_options options;
+
+#define GROUP_FANOUT     1           // With PtzAxisGroup (-g)
+#define GROUP_SEQUENTIAL 2           // One camera after the other, as a client would (-G)
+static volatile bool running;
+static FILE* out;                  // The results, stdout is left to the devices
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu_seconds()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+}
+
+// Latency samples in seconds
+class Samples
+{
+public:
+  void   add(double v) { values.push_back(v); }
+  size_t count() const { return values.size(); }
+  double mean() const
+  {
+    double sum = 0;
+    for (size_t i = 0; i < values.size(); i++)
+      sum += values[i];
+    return values.empty() ? 0 : sum / values.size();
+  }
+  double percentile(double p)
+  {
+    if (values.empty())
+      return 0;
+    std::sort(values.begin(), values.end());
+    return values[(size_t)(p * (values.size() - 1))];
+  }
+  void   merge(const Samples& other)
+  {
+    values.insert(values.end(), other.values.begin(), other.values.end());
+  }
+
+private:
+  vector<double> values;
+};
+
+// Everything about one camera under test
+typedef struct _load_camera {
+  string            ip;
+  string            url;          // Stream url, must live as long as camera
+  CameraAxisDevice* camera;
+  PtzAxisDevice*    ptz;
+  PtzAxisController* controller;  // Only with -C
+  pthread_t         ptz_thread;
+
+  unsigned long     bytes;        // Frame bytes received
+  Samples           frame_latency;
+  Samples           cmd_latency;
+  Samples           query_latency;
+  Samples           tracking_error; // Only with -C, degree
+  unsigned long     moves;        // PTZ commands sent
+  unsigned long     ptz_errors;
+} load_camera;
+
+// All the cameras moved as one, with -g or -G
+typedef struct _load_group {
+  vector<load_camera>* cameras;
+  PtzAxisGroup*     group;        // Only with -g
+  pthread_t         thread;
+  Samples           spread;       // Between the first and the last camera got a command, s
+} load_group;
+
+/////////////////////////////////////////////////////////////
+// The simulator, a child process
+
+static pid_t start_sim(int cameras)
+{
+  char n[16], p[16], f[16];
+  snprintf(n, sizeof(n), "%d", cameras);
+  snprintf(p, sizeof(p), "%d", options.port);
+  snprintf(f, sizeof(f), "%d", options.fps);
+
+  vector<char*> argv;
+  argv.push_back((char*)options.sim.c_str());
+  argv.push_back((char*)"-n"); argv.push_back(n);
+  argv.push_back((char*)"-p"); argv.push_back(p);
+  argv.push_back((char*)"-f"); argv.push_back(f);
+  argv.push_back((char*)"-r"); argv.push_back((char*)options.resolution.c_str());
+  char* extra = strdup(options.sim_args.c_str());
+  for (char* arg = strtok(extra, " "); arg; arg = strtok(NULL, " "))
+    argv.push_back(arg);
+  argv.push_back(NULL);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    execv(options.sim.c_str(), &argv[0]);
+    perror("AxisLoad: cannot start the simulator");
+    _exit(1);
+  }
+  free(extra);
+  return pid;
+}
+
+// Wait until all the simulated cameras accept connections
+static bool wait_sim(int cameras)
+{
+  for (int tries = 0; tries < 200; tries++) {
+    int ready = 0;
+    for (int i = 0; i < cameras; i++) {
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family      = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      addr.sin_port        = htons(options.port + i);
+      if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+	ready++;
+      close(fd);
+    }
+    if (ready == cameras)
+      return true;
+    usleep(10000);
+  }
+  return false;
+}
+
+static void stop_sim(pid_t pid)
+{
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+}
+
+/////////////////////////////////////////////////////////////
+// The load: one thread reading all the frames, one per PTZ
+
+// Latency from the timestamp axissim puts in a COM segment after SOI
+static bool frame_stamp(const queuedframe& f, double& stamp)
+{
+  if (f.image_count < 8 || f.image[2] != 0xFF || f.image[3] != 0xFE)
+    return false;
+  size_t len = (f.image[4] << 8) | f.image[5];
+  if (len < 2 || 4 + len > f.image_count)
+    return false;
+  string text((char*)f.image + 6, len - 2);
+  return sscanf(text.c_str(), "t=%lf", &stamp) == 1;
+}
+
+static void* consumer_thread(void* ptr)
+{
+  vector<load_camera>* cameras = (vector<load_camera>*)ptr;
+
+  // Like CameraAxis::Main(), but polling all the cameras and sleeping when idle
+  while (running) {
+    bool idle = true;
+    for (size_t i = 0; i < cameras->size(); i++) {
+      load_camera& c = (*cameras)[i];
+      while (c.camera->framesWaiting()) {
+	queuedframe f = c.camera->dequeue();
+	double stamp;
+	if (frame_stamp(f, stamp))
+	  c.frame_latency.add(now() - stamp);
+	c.bytes += f.image_count;
+	free(f.image);
+	idle = false;
+      }
+    }
+    if (idle)
+      usleep(CONSUMER_SLEEP_USEC);
+  }
+  return NULL;
+}
+
+static void* ptz_thread(void* ptr)
+{
+  load_camera* c = (load_camera*)ptr;
+  unsigned int seed = (unsigned int)(size_t)ptr;
+  double period = 1.0 / options.ptz_rate;
+  double next = now();
+
+  // Like PtzAxis: a command now and then, and the state polled after each
+  while (running) {
+    double t0 = now();
+    bool ok = c->ptz->move(rand_r(&seed) % 340 - 170.0, rand_r(&seed) % 120 - 90.0, 90);
+    double t1 = now();
+    ok = c->ptz->updateState() && ok;
+    double t2 = now();
+
+    c->cmd_latency.add(t1 - t0);
+    c->query_latency.add(t2 - t1);
+    c->moves++;
+    if (!ok)
+      c->ptz_errors++;
+
+    next += period;
+    double wait = next - now();
+    if (wait > 0)
+      usleep((useconds_t)(wait * 1e6));
+  }
+  return NULL;
+}
+
+// Target the controller follows: a slow figure of eight, degree
+static void target_at(double t, float& pan, float& tilt)
+{
+  pan  = 60 * sin(2 * M_PI * t / 8);
+  tilt = -30 + 20 * sin(2 * M_PI * t / 4);
+}
+
+static void* controller_thread(void* ptr)
+{
+  load_camera* c = (load_camera*)ptr;
+  double period = 1.0 / options.ptz_rate;
+  double start = now();
+  double next = start;
+
+  // The controller owns c->ptz, the real pose comes from a second device
+  PtzAxisDevice probe(c->ip);
+  probe.verbose = false;
+
+  // Like PtzAxis in controller mode: a new target now and then. With a
+  // burst, the targets a client sent over the period reach the controller
+  // together, as from one ProcessMessages() pass.
+  while (running) {
+    float pan, tilt;
+    double t = now() - start;
+    for (int k = options.burst - 1; k >= 0; k--) {
+      target_at(t - period * k / options.burst, pan, tilt);
+      c->controller->setTarget(pan, tilt, 1);
+    }
+
+    double t0 = now();
+    bool ok = probe.updateState();
+    c->query_latency.add(now() - t0);
+    if (ok) {
+      target_at(now() - start, pan, tilt);
+      c->tracking_error.add(hypot(pan - probe.state.pan, tilt - probe.state.tilt));
+    }
+    else
+      c->ptz_errors++;
+
+    next += period;
+    double wait = next - now();
+    if (wait > 0)
+      usleep((useconds_t)(wait * 1e6));
+  }
+  return NULL;
+}
+
+// Spread of the arrivals of the last command at the cameras, as stamped
+// by axissim in "lastcommand" (CLOCK_MONOTONIC, shared with axissim)
+static bool arrival_spread(AxisReactor* reactor, vector<load_camera>& cameras,
+			   const vector<char>& lanes, double& spread)
+{
+  vector<AxisReactor::batch_request> queries(cameras.size());
+  for (size_t i = 0; i < cameras.size(); i++) {
+    queries[i].lane  = &lanes[i];
+    queries[i].url   = cameras[i].ip + "/axis-cgi/com/ptz.cgi?query=position";
+    queries[i].kind  = 0;
+    queries[i].delay = 0;
+  }
+  if (!reactor->performBatch(queries))
+    return false;
+
+  double first = 0, last = 0;
+  for (size_t i = 0; i < queries.size(); i++) {
+    const char* stamp = strstr(queries[i].body.c_str(), "lastcommand=");
+    if (!stamp)
+      return false;
+    double t = atof(stamp + 12);
+    first = (i == 0) ? t : fmin(first, t);
+    last  = (i == 0) ? t : fmax(last, t);
+  }
+  spread = last - first;
+  return true;
+}
+
+static void* group_thread(void* ptr)
+{
+  load_group* g = (load_group*)ptr;
+  vector<load_camera>& cameras = *g->cameras;
+  AxisReactor* reactor = AxisReactor::acquire();
+  vector<char> lanes(cameras.size());        // Of the arrival queries
+  unsigned int seed = 1;
+  double period = 1.0 / options.ptz_rate;
+  double next = now();
+
+  // Like PtzAxis in group mode: one command for all the cameras, the
+  // state of all of them polled after it (the group only sends the polls)
+  while (running) {
+    float pan  = rand_r(&seed) % 340 - 170.0;
+    float tilt = rand_r(&seed) % 120 - 90.0;
+    vector<ptz_result> results(cameras.size());
+
+    double t0 = now();
+    if (g->group) {
+      g->group->move(pan, tilt, 90);
+      results = g->group->results();
+    }
+    else
+      for (size_t i = 0; i < cameras.size(); i++) {
+	results[i].sent     = now() - t0;
+	results[i].ok       = cameras[i].ptz->move(pan, tilt, 90);
+	results[i].answered = now() - t0;
+      }
+    double t1 = now();
+    bool ok = g->group ? g->group->updateState() : true;
+    if (!g->group)
+      for (size_t i = 0; i < cameras.size(); i++)
+	ok = cameras[i].ptz->updateState() && ok;
+    double t2 = now();
+
+    for (size_t i = 0; i < cameras.size(); i++) {
+      load_camera& c = cameras[i];
+      c.cmd_latency.add(results[i].answered);
+      // The group polls in the background: its round trips instead
+      c.query_latency.add(g->group ? fmax(g->group->roundTrip(i), 0) : t2 - t1);
+      c.moves++;
+      if (!results[i].ok || !ok)
+	c.ptz_errors++;
+    }
+    double spread;
+    if (arrival_spread(reactor, cameras, lanes, spread))
+      g->spread.add(spread);
+
+    next += period;
+    double wait = next - now();
+    if (wait > 0)
+      usleep((useconds_t)(wait * 1e6));
+  }
+  AxisReactor::release();
+  return NULL;
+}
+
+static void run_step(int n)
+{
+  pid_t sim = start_sim(n);
+  if (!wait_sim(n)) {
+    fprintf(stderr, "AxisLoad: simulator did not come up for %d cameras\n", n);
+    stop_sim(sim);
+    return;
+  }
+
+  vector<load_camera> cameras(n);
+  running = true;
+  for (int i = 0; i < n; i++) {
+    char ip[32];
+    snprintf(ip, sizeof(ip), "127.0.0.1:%d", options.port + i);
+    load_camera& c = cameras[i];
+    c.ip    = ip;
+    c.url   = c.ip + "/axis-cgi/mjpg/video.cgi";
+    c.bytes = 0;
+    c.moves = 0;
+    c.ptz_errors = 0;
+    c.camera = new CameraAxisDevice(c.url.c_str());
+    c.ptz    = new PtzAxisDevice(ip);
+    c.ptz->verbose = false;
+    c.controller = NULL;
+    if (options.controller && options.ptz_rate > 0)
+      c.controller = new PtzAxisController(c.ptz, PtzAxisController::defaults());
+  }
+
+  double wall0 = now();
+  double cpu0  = cpu_seconds();
+
+  load_group g;
+  g.cameras = &cameras;
+  g.group   = NULL;
+  if (options.group == GROUP_FANOUT) {
+    vector<string> ips;
+    for (int i = 0; i < n; i++)
+      ips.push_back(cameras[i].ip);
+    g.group = new PtzAxisGroup(ips);
+    g.group->verbose = false;
+    g.group->align   = options.align;
+    g.group->warmUp();
+  }
+
+  pthread_t consumer;
+  pthread_create(&consumer, NULL, consumer_thread, &cameras);
+  if (options.ptz_rate > 0 && options.group)
+    pthread_create(&g.thread, NULL, group_thread, &g);
+  else if (options.ptz_rate > 0)
+    for (int i = 0; i < n; i++)
+      pthread_create(&cameras[i].ptz_thread, NULL,
+		     options.controller ? controller_thread : ptz_thread, &cameras[i]);
+
+  sleep(options.seconds);
+  running = false;
+
+  pthread_join(consumer, NULL);
+  if (options.ptz_rate > 0 && options.group)
+    pthread_join(g.thread, NULL);
+  else if (options.ptz_rate > 0)
+    for (int i = 0; i < n; i++)
+      pthread_join(cameras[i].ptz_thread, NULL);
+  delete g.group;
+
+  double wall = now() - wall0;
+  double cpu  = cpu_seconds() - cpu0;
+
+  unsigned long dropped = 0, bytes = 0, errors = 0;
+  unsigned long moves = 0;
+  Samples frames, cmds, queries;
+  // The "cmd" columns: command latency in ms, tracking error in degree with
+  // -C, or in the total row the arrival spread of the group in ms with -g/-G
+  double scale = options.controller ? 1 : 1e3;
+  for (int i = 0; i < n; i++) {
+    load_camera& c = cameras[i];
+    Samples& cmd = options.controller ? c.tracking_error : c.cmd_latency;
+    if (c.controller) {
+      c.moves = c.controller->commandsSent();
+      delete c.controller;
+    }
+    dropped += c.camera->framesDropped();
+    bytes   += c.bytes;
+    errors  += c.ptz_errors;
+    moves   += c.moves;
+    frames.merge(c.frame_latency);
+    if (!options.group)
+      cmds.merge(cmd);
+    queries.merge(c.query_latency);
+
+    if (options.verbose)
+      fprintf(out, "    cam %3d %7.1f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %6lu %6lu %7s %7.1f\n",
+	     i, c.frame_latency.count() / wall, c.bytes / wall / 1e6,
+	     c.frame_latency.mean() * 1e3, c.frame_latency.percentile(0.95) * 1e3,
+	     cmd.mean() * scale, cmd.percentile(0.95) * scale,
+	     c.query_latency.mean() * 1e3, c.camera->framesDropped(), c.ptz_errors,
+	     "", c.moves / wall);
+
+    delete c.camera;
+    delete c.ptz;
+  }
+  stop_sim(sim);
+  if (options.group)
+    cmds = g.spread;
+
+  fprintf(out, "%5d %7.1f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %6lu %6lu %7.1f %7.1f\n",
+	 n, frames.count() / wall / n, bytes / wall / 1e6 / n,
+	 frames.mean() * 1e3, frames.percentile(0.95) * 1e3,
+	 cmds.mean() * scale, cmds.percentile(0.95) * scale,
+	 queries.mean() * 1e3, dropped, errors, 100.0 * cpu / wall / n, moves / wall / n);
+  fflush(out);
+}
+
+static void usage()
+{
+  fprintf(stderr,
+	  "usage: axisload [options]\n"
+	  "  -n cameras     largest number of cameras, steps are 1, 2, 4, ... (%d)\n"
+	  "  -p port        port of the first simulated camera (%d)\n"
+	  "  -t seconds     duration of each step (%d)\n"
+	  "  -f fps         frames per second of the simulated cameras (%d)\n"
+	  "  -r WxH         resolution of the simulated cameras (768x576)\n"
+	  "  -q rate        PTZ commands per second and camera, 0 for none (%d)\n"
+	  "  -s path        the simulator (./axissim)\n"
+	  "  -x \"options\"   more simulator options, e.g. \"-c 1400 -j 5 -d 250\"\n"
+	  "  -C             follow a moving target with the closed-loop controller\n"
+	  "  -b targets     with -C, targets handed over back to back each time (1)\n"
+	  "  -g             move all the cameras together with PtzAxisGroup\n"
+	  "  -G             move all the cameras together, one after the other\n"
+	  "  -A             with -g, do not hold back the nearer cameras\n"
+	  "  -v             a row per camera too\n",
+	  DEFAULT_MAX_CAMERAS, DEFAULT_PORT, DEFAULT_SECONDS, DEFAULT_FPS, DEFAULT_PTZ_RATE);
+  exit(1);
+}
+
+int main(int argc, char** argv)
+{
+  options.sim         = "./axissim";
+  options.max_cameras = DEFAULT_MAX_CAMERAS;
+  options.port        = DEFAULT_PORT;
+  options.seconds     = DEFAULT_SECONDS;
+  options.fps         = DEFAULT_FPS;
+  options.resolution  = "768x576";
+  options.ptz_rate    = DEFAULT_PTZ_RATE;
+  options.burst       = 1;
+  options.verbose     = false;
+  options.controller  = false;
+  options.group       = 0;
+  options.align       = true;
+
+  int c;
+  while ((c = getopt(argc, argv, "n:p:t:f:r:q:b:s:x:CgGAvh")) != -1) {
+    switch (c) {
+    case 'n': options.max_cameras = atoi(optarg); break;
+    case 'p': options.port        = atoi(optarg); break;
+    case 't': options.seconds     = atoi(optarg); break;
+    case 'f': options.fps         = atoi(optarg); break;
+    case 'r': options.resolution  = optarg;       break;
+    case 'q': options.ptz_rate    = atoi(optarg); break;
+    case 'b': options.burst       = atoi(optarg); break;
+    case 's': options.sim         = optarg;       break;
+    case 'x': options.sim_args    = optarg;       break;
+    case 'v': options.verbose     = true;         break;
+    case 'C': options.controller  = true;         break;
+    case 'g': options.group       = GROUP_FANOUT;     break;
+    case 'G': options.group       = GROUP_SEQUENTIAL; break;
+    case 'A': options.align       = false;            break;
+    default:  usage();
+    }
+  }
+  if (options.max_cameras < 1 || options.seconds < 1 || options.burst < 1 || (options.controller && options.group))
+    usage();
+
+  // Before any thread: CURL's global init is not thread safe
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  // The devices report on stdout, keep it for the results
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+
+  fprintf(out, "# %d s per step, %d fps %s %s, %d PTZ commands/s per camera\n",
+	  options.seconds, options.fps, options.resolution.c_str(),
+	  options.sim_args.c_str(), options.ptz_rate);
+  fprintf(out, "# per camera: frames/s, MB/s, frame latency (mean, p95) in ms, %s,\n"
+	  "# query latency in ms, frames dropped, PTZ errors, %% of a CPU, PTZ commands/s\n",
+	  options.controller ? "tracking error (mean, p95) in degree" :
+	  options.group      ? "spread of a group command's arrivals (mean, p95) in ms"
+	                     : "PTZ command latency (mean, p95) in ms");
+  fprintf(out, "%5s %7s %7s %7s %7s %7s %7s %7s %6s %6s %7s %7s\n", "cams", "fps", "MB/s",
+	  "frame", "p95", options.controller ? "err" : options.group ? "spread" : "cmd", "p95", "query",
+	  "drops", "errors", "cpu%", "cmd/s");
+  fflush(out);
+
+  for (int n = 1; ; n *= 2) {
+    if (n > options.max_cameras)
+      n = options.max_cameras;
+    run_step(n);
+    if (n == options.max_cameras)
+      break;
+  }
+
+  curl_global_cleanup();
+  return 0;
+}
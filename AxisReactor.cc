@@ -0,0 +1,635 @@
+/****************************************************************************\
+ *  AxisReactor                                                             *
+ *  Shared HTTP I/O engine of the CameraAxis and PtzAxis drivers            *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  See AxisReactor.h                                                       *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "AxisReactor.h"
+
+using std::string;
+
+#define REACTOR_MAX_EVENTS      64
+#define REQUEST_TIMEOUT_SEC     5        // A camera that does not answer a command
+#define CONNECT_TIMEOUT_SEC     3
+#define STREAM_STALL_SEC        5        // A stream that sends nothing is reconnected
+#define MAX_CONNECTIONS         256      // Idle connections kept for reuse
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+pthread_mutex_t AxisReactor::refmutex = PTHREAD_MUTEX_INITIALIZER;
+AxisReactor*    AxisReactor::instance = NULL;
+int             AxisReactor::refcount = 0;
+
+AxisReactor* AxisReactor::acquire()
+{
+  pthread_mutex_lock(&refmutex);
+  if (refcount++ == 0) {
+    curl_global_init(CURL_GLOBAL_ALL);
+    instance = new AxisReactor();
+  }
+  AxisReactor* r = instance;
+  pthread_mutex_unlock(&refmutex);
+  return r;
+}
+
+void AxisReactor::release()
+{
+  pthread_mutex_lock(&refmutex);
+  if (--refcount == 0) {
+    delete instance;
+    instance = NULL;
+    curl_global_cleanup();
+  }
+  pthread_mutex_unlock(&refmutex);
+}
+
+AxisReactor::AxisReactor()
+{
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&removed_cond, NULL);
+  next_stream_id = 1;
+  timer_at = 0;
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events  = EPOLLIN;
+  ev.data.fd = wake_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+  multi = curl_multi_init();
+  curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, &AxisReactor::socketCallback);
+  curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+  curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, &AxisReactor::timerCallback);
+  curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+  // Keep the idle keep-alive connection of every camera: curl's default
+  // cache is sized after the transfers running at once
+  curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)MAX_CONNECTIONS);
+
+  running = true;
+  pthread_create(&loop_thread, NULL, &AxisReactor::start_loop_thread, (void*)this);
+  puts("AxisReactor: I/O thread started.");
+}
+
+AxisReactor::~AxisReactor()
+{
+  running = false;
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0)
+    perror("AxisReactor: wake up");
+  pthread_join(loop_thread, NULL);
+
+  // Whatever request is left fails: waiting callers must not hang
+  for (std::map<const void*, std::deque<transfer*> >::iterator l = lanes.begin(); l != lanes.end(); ++l)
+    for (size_t i = 0; i < l->second.size(); i++) {
+      complete(l->second[i], false);
+      closeTransfer(l->second[i]);
+    }
+  for (size_t i = 0; i < delayed.size(); i++) {
+    complete(delayed[i], false);
+    closeTransfer(delayed[i]);
+  }
+  for (std::map<int, transfer*>::iterator s = streams.begin(); s != streams.end(); ++s)
+    closeTransfer(s->second);
+  for (size_t i = 0; i < messages.size(); i++)
+    if (messages[i].t) {
+      if (messages[i].type == message::REQUEST)
+	complete(messages[i].t, false);
+      closeTransfer(messages[i].t);
+    }
+
+  curl_multi_cleanup(multi);
+  close(wake_fd);
+  close(epoll_fd);
+  pthread_cond_destroy(&removed_cond);
+  pthread_mutex_destroy(&mutex);
+  puts("AxisReactor: I/O thread exit.");
+}
+
+/////////////////////////////////////////////////////////////
+// Interface, any thread
+
+void AxisReactor::post(const message& m)
+{
+  pthread_mutex_lock(&mutex);
+  messages.push_back(m);
+  pthread_mutex_unlock(&mutex);
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0)
+    perror("AxisReactor: wake up");
+}
+
+void AxisReactor::submit(const void* lane, const string& url, completion done, void* data,
+			 int kind)
+{
+  transfer* t = new transfer;
+  t->easy       = NULL;
+  t->url        = url;
+  t->lane       = lane;
+  t->kind       = kind;
+  t->done       = done;
+  t->write      = NULL;
+  t->data       = data;
+  t->stream_id  = 0;
+  t->retry_usec = 0;
+  t->retry_at   = 0;
+  t->group      = NULL;
+  t->index      = 0;
+  t->start_at   = 0;
+  t->started    = 0;
+
+  message m = {message::REQUEST, t, 0};
+  post(m);
+}
+
+void AxisReactor::submitBatch(const std::vector<batch_request>& requests, batch_completion done,
+			      void* data)
+{
+  batch* b = new batch;
+  b->requests = requests;
+  b->left     = requests.size();
+  b->queued   = now();
+  b->done     = done;
+  b->data     = data;
+  if (requests.empty()) {
+    done(data, b->requests);
+    delete b;
+    return;
+  }
+
+  std::vector<message> batched;
+  for (size_t i = 0; i < requests.size(); i++) {
+    transfer* t = new transfer;
+    t->easy       = NULL;
+    t->url        = requests[i].url;
+    t->lane       = requests[i].lane;
+    t->kind       = requests[i].kind;
+    t->done       = NULL;
+    t->write      = NULL;
+    t->data       = NULL;
+    t->stream_id  = 0;
+    t->retry_usec = 0;
+    t->retry_at   = 0;
+    t->group      = b;
+    t->index      = i;
+    t->start_at   = requests[i].delay > 0 ? b->queued + requests[i].delay : 0;
+    t->started    = 0;
+    message m = {message::REQUEST, t, 0};
+    batched.push_back(m);
+  }
+
+  // All in one go, so the loop sees them in the same iteration
+  pthread_mutex_lock(&mutex);
+  messages.insert(messages.end(), batched.begin(), batched.end());
+  pthread_mutex_unlock(&mutex);
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0)
+    perror("AxisReactor: wake up");
+}
+
+// Lets perform() wait for the reactor thread
+typedef struct _waiter {
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  bool            done;
+  bool            ok;
+  string*         body;
+} waiter;
+
+static void wake_waiter(void* data, bool ok, const string& body)
+{
+  waiter* w = (waiter*)data;
+  pthread_mutex_lock(&w->mutex);
+  w->ok   = ok;
+  if (w->body)
+    *w->body = body;
+  w->done = true;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+}
+
+// Lets performBatch() wait for the reactor thread
+typedef struct _batch_waiter {
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  bool            done;
+  std::vector<AxisReactor::batch_request>* requests;
+} batch_waiter;
+
+static void wake_batch_waiter(void* data, std::vector<AxisReactor::batch_request>& requests)
+{
+  batch_waiter* w = (batch_waiter*)data;
+  pthread_mutex_lock(&w->mutex);
+  *w->requests = requests;
+  w->done = true;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+}
+
+bool AxisReactor::performBatch(std::vector<batch_request>& requests)
+{
+  if (pthread_equal(pthread_self(), loop_thread)) {
+    fputs("AxisReactor: performBatch() from a callback would never return\n", stderr);
+    return false;
+  }
+
+  batch_waiter w;
+  pthread_mutex_init(&w.mutex, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  w.done     = false;
+  w.requests = &requests;
+
+  // See perform()
+  int oldstate;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+  submitBatch(requests, &wake_batch_waiter, &w);
+
+  pthread_mutex_lock(&w.mutex);
+  while (!w.done)
+    pthread_cond_wait(&w.cond, &w.mutex);
+  pthread_mutex_unlock(&w.mutex);
+  pthread_setcancelstate(oldstate, NULL);
+
+  pthread_cond_destroy(&w.cond);
+  pthread_mutex_destroy(&w.mutex);
+
+  for (size_t i = 0; i < requests.size(); i++)
+    if (!requests[i].ok)
+      return false;
+  return true;
+}
+
+bool AxisReactor::perform(const void* lane, const string& url, string* body, int kind)
+{
+  if (pthread_equal(pthread_self(), loop_thread)) {
+    fputs("AxisReactor: perform() from a callback would never return\n", stderr);
+    return false;
+  }
+
+  waiter w;
+  pthread_mutex_init(&w.mutex, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  w.done = false;
+  w.ok   = false;
+  w.body = body;
+
+  // Not cancelled while the reactor may still signal "w" (Player cancels
+  // the driver threads), the request timeout bounds the wait
+  int oldstate;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+  submit(lane, url, &wake_waiter, &w, kind);
+
+  pthread_mutex_lock(&w.mutex);
+  while (!w.done)
+    pthread_cond_wait(&w.cond, &w.mutex);
+  pthread_mutex_unlock(&w.mutex);
+  pthread_setcancelstate(oldstate, NULL);
+
+  pthread_cond_destroy(&w.cond);
+  pthread_mutex_destroy(&w.mutex);
+  return w.ok;
+}
+
+int AxisReactor::addStream(const string& url, writer write, completion ended, void* data,
+			   long retry_usec)
+{
+  transfer* t = new transfer;
+  t->easy       = NULL;
+  t->url        = url;
+  t->lane       = NULL;
+  t->kind       = 0;
+  t->done       = ended;
+  t->write      = write;
+  t->data       = data;
+  t->retry_usec = retry_usec;
+  t->retry_at   = 0;
+  t->group      = NULL;
+  t->index      = 0;
+  t->start_at   = 0;
+  t->started    = 0;
+
+  pthread_mutex_lock(&mutex);
+  t->stream_id = next_stream_id++;
+  pthread_mutex_unlock(&mutex);
+
+  message m = {message::ADD_STREAM, t, 0};
+  post(m);
+  return t->stream_id;
+}
+
+void AxisReactor::removeStream(int id)
+{
+  message m = {message::REMOVE_STREAM, NULL, id};
+  post(m);
+
+  pthread_mutex_lock(&mutex);
+  while (removed.find(id) == removed.end())
+    pthread_cond_wait(&removed_cond, &mutex);
+  removed.erase(id);
+  pthread_mutex_unlock(&mutex);
+}
+
+/////////////////////////////////////////////////////////////
+// Event loop, reactor thread only
+
+void* AxisReactor::start_loop_thread(void* ptr)
+{
+  ((AxisReactor*)ptr)->loop();
+  return NULL;
+}
+
+int AxisReactor::socketCallback(CURL*, curl_socket_t s, int what, void* userp, void*)
+{
+  AxisReactor* me = (AxisReactor*)userp;
+
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(me->epoll_fd, EPOLL_CTL_DEL, s, NULL);
+    return 0;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.data.fd = s;
+  if (what & CURL_POLL_IN)
+    ev.events |= EPOLLIN;
+  if (what & CURL_POLL_OUT)
+    ev.events |= EPOLLOUT;
+  if (epoll_ctl(me->epoll_fd, EPOLL_CTL_MOD, s, &ev) < 0 && errno == ENOENT)
+    epoll_ctl(me->epoll_fd, EPOLL_CTL_ADD, s, &ev);
+  return 0;
+}
+
+int AxisReactor::timerCallback(CURLM*, long timeout_ms, void* userp)
+{
+  AxisReactor* me = (AxisReactor*)userp;
+  me->timer_at = (timeout_ms < 0) ? 0 : now() + timeout_ms / 1000.0;
+  return 0;
+}
+
+size_t AxisReactor::bodyWriter(void* ptr, size_t size, size_t nmemb, void* data)
+{
+  transfer* t = (transfer*)data;
+  t->body.append((char*)ptr, size * nmemb);
+  return size * nmemb;
+}
+
+// Milliseconds epoll may sleep: until curl's deadline, the next reconnection
+// or the next delayed request. Rounded down, the last millisecond is spun
+// so delayed requests leave on time.
+int AxisReactor::nextTimeout()
+{
+  double next = timer_at;
+  for (std::map<int, transfer*>::iterator s = streams.begin(); s != streams.end(); ++s)
+    if (s->second->retry_at > 0 && (next == 0 || s->second->retry_at < next))
+      next = s->second->retry_at;
+  for (size_t i = 0; i < delayed.size(); i++)
+    if (next == 0 || delayed[i]->start_at < next)
+      next = delayed[i]->start_at;
+  if (next == 0)
+    return -1;
+  double wait = next - now();
+  return wait <= 0 ? 0 : (int)(wait * 1000);
+}
+
+void AxisReactor::loop()
+{
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  int still_running;
+
+  while (running) {
+    int n = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, nextTimeout());
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == wake_fd) {
+	uint64_t count;
+	if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+	  perror("AxisReactor: wake up");
+	continue;
+      }
+      int flags = 0;
+      if (events[i].events & EPOLLIN)
+	flags |= CURL_CSELECT_IN;
+      if (events[i].events & EPOLLOUT)
+	flags |= CURL_CSELECT_OUT;
+      if (events[i].events & (EPOLLERR | EPOLLHUP))
+	flags |= CURL_CSELECT_ERR;
+      curl_multi_socket_action(multi, events[i].data.fd, flags, &still_running);
+    }
+
+    if (timer_at > 0 && now() >= timer_at) {
+      timer_at = 0;
+      curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &still_running);
+    }
+
+    handleMessages();
+
+    // Release the delayed requests that are due
+    double t = now();
+    for (size_t i = 0; i < delayed.size(); )
+      if (t >= delayed[i]->start_at) {
+	queueRequest(delayed[i]);
+	delayed.erase(delayed.begin() + i);
+      }
+      else
+	i++;
+
+    // Reconnect the streams that are due
+    for (std::map<int, transfer*>::iterator s = streams.begin(); s != streams.end(); ++s)
+      if (s->second->retry_at > 0 && t >= s->second->retry_at)
+	startStream(s->second);
+
+    CURLMsg* msg;
+    int left;
+    while ((msg = curl_multi_info_read(multi, &left)))
+      if (msg->msg == CURLMSG_DONE)
+	finished(msg->easy_handle, msg->data.result);
+  }
+}
+
+void AxisReactor::handleMessages()
+{
+  std::deque<message> pending;
+  pthread_mutex_lock(&mutex);
+  pending.swap(messages);
+  pthread_mutex_unlock(&mutex);
+
+  for (size_t i = 0; i < pending.size(); i++) {
+    message& m = pending[i];
+    switch (m.type) {
+
+    case message::REQUEST:
+      if (m.t->start_at > now())
+	delayed.push_back(m.t);
+      else
+	queueRequest(m.t);
+      break;
+
+    case message::ADD_STREAM:
+      streams[m.t->stream_id] = m.t;
+      startStream(m.t);
+      break;
+
+    case message::REMOVE_STREAM: {
+      std::map<int, transfer*>::iterator s = streams.find(m.stream_id);
+      if (s != streams.end()) {
+	closeTransfer(s->second);
+	streams.erase(s);
+      }
+      pthread_mutex_lock(&mutex);
+      removed.insert(m.stream_id);
+      pthread_cond_broadcast(&removed_cond);
+      pthread_mutex_unlock(&mutex);
+      break;
+    }
+    }
+  }
+}
+
+void AxisReactor::queueRequest(transfer* t)
+{
+  std::deque<transfer*>& lane = lanes[t->lane];
+
+  // The front is running; a waiting request of the same kind is stale.
+  // Dropped rather than replaced in place, so the newest requests keep
+  // the order they came in (a zoom still goes before its move).
+  if (t->kind != 0)
+    for (size_t i = 1; i < lane.size(); i++)
+      if (lane[i]->kind == t->kind) {
+	transfer* stale = lane[i];
+	lane.erase(lane.begin() + i);
+	stale->body = AXIS_REACTOR_SUPERSEDED;
+	if (stale->group)
+	  stale->group->requests[stale->index].answered = now() - stale->group->queued;
+	complete(stale, false);
+	closeTransfer(stale);
+	break;
+      }
+
+  lane.push_back(t);
+  if (lane.size() == 1)
+    startRequest(t);
+}
+
+void AxisReactor::startRequest(transfer* t)
+{
+  t->started = now();
+  t->easy = curl_easy_init();
+  curl_easy_setopt(t->easy, CURLOPT_URL, t->url.c_str());
+  curl_easy_setopt(t->easy, CURLOPT_WRITEFUNCTION, &AxisReactor::bodyWriter);
+  curl_easy_setopt(t->easy, CURLOPT_WRITEDATA, t);
+  curl_easy_setopt(t->easy, CURLOPT_PRIVATE, t);
+  curl_easy_setopt(t->easy, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(t->easy, CURLOPT_TIMEOUT, (long)REQUEST_TIMEOUT_SEC);
+  curl_easy_setopt(t->easy, CURLOPT_CONNECTTIMEOUT, (long)CONNECT_TIMEOUT_SEC);
+  curl_easy_setopt(t->easy, CURLOPT_TCP_NODELAY, 1L);
+  curl_multi_add_handle(multi, t->easy);
+}
+
+void AxisReactor::startStream(transfer* t)
+{
+  t->retry_at = 0;
+  t->easy = curl_easy_init();
+  curl_easy_setopt(t->easy, CURLOPT_URL, t->url.c_str());
+  curl_easy_setopt(t->easy, CURLOPT_WRITEFUNCTION, t->write);
+  curl_easy_setopt(t->easy, CURLOPT_WRITEDATA, t->data);
+  curl_easy_setopt(t->easy, CURLOPT_PRIVATE, t);
+  curl_easy_setopt(t->easy, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(t->easy, CURLOPT_CONNECTTIMEOUT, (long)CONNECT_TIMEOUT_SEC);
+  curl_easy_setopt(t->easy, CURLOPT_LOW_SPEED_LIMIT, 1L);
+  curl_easy_setopt(t->easy, CURLOPT_LOW_SPEED_TIME, (long)STREAM_STALL_SEC);
+  curl_multi_add_handle(multi, t->easy);
+}
+
+void AxisReactor::finished(CURL* easy, CURLcode result)
+{
+  transfer* t;
+  long http_code = 0;
+  double pretransfer = 0;
+  curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char**)&t);
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &http_code);
+  curl_easy_getinfo(easy, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+  curl_multi_remove_handle(multi, easy);
+  curl_easy_cleanup(easy);
+  t->easy = NULL;
+
+  if (t->stream_id) {
+    // The stream only ends when the camera drops it: reconnect later
+    fprintf(stderr, "AxisReactor: Stream %s ended (%s), reconnecting...\n",
+	    t->url.c_str(), curl_easy_strerror(result));
+    t->retry_at = now() + t->retry_usec / 1e6;
+    if (t->done)
+      t->done(t->data, false, "");
+    return;
+  }
+
+  if (t->group) {
+    batch_request& r = t->group->requests[t->index];
+    r.sent     = t->started + pretransfer - t->group->queued;
+    r.answered = now() - t->group->queued;
+  }
+  complete(t, result == CURLE_OK && http_code < 400);
+
+  // Next request of the lane
+  std::deque<transfer*>& lane = lanes[t->lane];
+  lane.pop_front();
+  if (!lane.empty())
+    startRequest(lane.front());
+  else
+    lanes.erase(t->lane);
+  delete t;
+}
+
+void AxisReactor::complete(transfer* t, bool ok)
+{
+  if (!t->group) {
+    if (t->done)
+      t->done(t->data, ok, t->body);
+    return;
+  }
+
+  batch* b = t->group;
+  b->requests[t->index].ok   = ok;
+  b->requests[t->index].body = t->body;
+  if (--b->left == 0) {
+    b->done(b->data, b->requests);
+    delete b;
+  }
+  t->group = NULL;
+}
+
+void AxisReactor::closeTransfer(transfer* t)
+{
+  if (t->easy) {
+    curl_multi_remove_handle(multi, t->easy);
+    curl_easy_cleanup(t->easy);
+  }
+  delete t;
+}
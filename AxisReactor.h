@@ -0,0 +1,175 @@
+/****************************************************************************\
+ *  AxisReactor                                                             *
+ *  Shared HTTP I/O engine of the CameraAxis and PtzAxis drivers            *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  One event loop thread per process (epoll + curl_multi) carries all the  *
+ *  traffic of all the devices: the MJPEG streams, the PTZ commands and the *
+ *  PTZ queries. The multi handle keeps one DNS and connection cache, so a  *
+ *  device reuses its keep-alive connection instead of opening one per      *
+ *  command. Devices share the reactor through acquire()/release().         *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#ifndef AXIS_REACTOR_H
+#define AXIS_REACTOR_H
+
+#include <pthread.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+
+// Body of a request replaced by a newer one of its kind before it started
+#define AXIS_REACTOR_SUPERSEDED "superseded"
+
+class AxisReactor
+{
+public:
+  // Called on the reactor thread when a request is done, must not block.
+  // ok: the camera answered with a success code; body: its answer.
+  typedef void (*completion)(void* data, bool ok, const std::string& body);
+
+  // Called on the reactor thread with the bytes of a stream, as a CURL write function
+  typedef size_t (*writer)(void* ptr, size_t size, size_t nmemb, void* data);
+
+  // One request of a batch, times in seconds since the batch was queued
+  typedef struct _batch_request {
+    const void*  lane;         // In: as for submit()
+    std::string  url;          // In
+    int          kind;         // In: as for submit()
+    double       delay;        // In: hold the request this long
+    bool         ok;           // Out: the camera answered with a success code
+    std::string  body;         // Out: its answer
+    double       sent;         // Out: when the request went on the wire
+    double       answered;     // Out: when the answer was complete
+  } batch_request;
+
+  // Called on the reactor thread once every request of a batch is done, must not block
+  typedef void (*batch_completion)(void* data, std::vector<batch_request>& requests);
+
+  // The reactor of the process, started by the first acquire and
+  // stopped by the last release
+  static AxisReactor* acquire();
+  static void         release();
+
+  // Queue a GET of "url". Requests with the same lane run one at a time,
+  // in order (e.g. a zoom before the move that follows it); different
+  // lanes run concurrently. A request of a non zero "kind" replaces the
+  // one of its kind still waiting in the lane, which completes with ok
+  // false and the body AXIS_REACTOR_SUPERSEDED: a camera slower than its
+  // client only runs the latest move.
+  void submit(const void* lane, const std::string& url, completion done, void* data,
+	      int kind = 0);
+
+  // Same, but wait for the answer. Not to be called from a callback.
+  bool perform(const void* lane, const std::string& url, std::string* body = NULL,
+	       int kind = 0);
+
+  // Queue several requests at once: they are all handed to curl in the
+  // same loop iteration (after their own delay), so they leave together.
+  void submitBatch(const std::vector<batch_request>& requests, batch_completion done, void* data);
+
+  // Same, but wait for all the answers, true if all succeeded.
+  // Not to be called from a callback.
+  bool performBatch(std::vector<batch_request>& requests);
+
+  // A long-lived GET whose bytes go to "write", reconnected after
+  // "retry_usec" whenever it ends, "ended" (if any) being told first.
+  // Returns an id for removeStream.
+  int  addStream(const std::string& url, writer write, completion ended, void* data,
+		 long retry_usec);
+  // Stop a stream: once this returns, "write" is not called anymore.
+  // Not to be called from a callback.
+  void removeStream(int id);
+
+private:
+  AxisReactor();
+  ~AxisReactor();
+
+  // Requests queued together, see submitBatch()
+  typedef struct _batch {
+    std::vector<batch_request> requests;
+    size_t           left;     // Requests not done yet
+    double           queued;   // When submitBatch was called
+    batch_completion done;
+    void*            data;
+  } batch;
+
+  // A request or a stream, CURLOPT_PRIVATE of its easy handle
+  typedef struct _transfer {
+    CURL*        easy;
+    std::string  url;
+    const void*  lane;         // Requests only
+    int          kind;         // Requests only, see submit()
+    std::string  body;         // Requests only
+    completion   done;         // Requests; streams: when they end
+    writer       write;        // Streams only
+    void*        data;
+    int          stream_id;    // 0 for requests
+    long         retry_usec;   // Streams only
+    double       retry_at;     // Streams only: when to reconnect, 0 if running
+    batch*       group;        // Batched requests only, "done" is not used then
+    size_t       index;        // In group->requests
+    double       start_at;     // Batched requests: not before, 0 for now
+    double       started;      // When handed to curl
+  } transfer;
+
+  // Control messages from the other threads, handled on the loop thread
+  typedef struct _message {
+    enum { REQUEST, ADD_STREAM, REMOVE_STREAM } type;
+    transfer*    t;            // REQUEST, ADD_STREAM
+    int          stream_id;    // REMOVE_STREAM
+  } message;
+
+  static void* start_loop_thread(void* ptr);
+  void   loop();
+  void   post(const message& m);
+  void   handleMessages();
+  void   startRequest(transfer* t);
+  void   startStream(transfer* t);
+  void   queueRequest(transfer* t);
+  void   finished(CURL* easy, CURLcode result);
+  void   complete(transfer* t, bool ok);
+  void   closeTransfer(transfer* t);
+  int    nextTimeout();
+
+  // curl_multi socket interface
+  static int    socketCallback(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp);
+  static int    timerCallback(CURLM* multi, long timeout_ms, void* userp);
+  static size_t bodyWriter(void* ptr, size_t size, size_t nmemb, void* data);
+
+  static pthread_mutex_t refmutex;   // Protects instance and refcount
+  static AxisReactor*    instance;
+  static int             refcount;
+
+  CURLM*          multi;
+  int             epoll_fd;
+  int             wake_fd;           // eventfd to wake up the loop
+  pthread_t       loop_thread;
+  volatile bool   running;
+  double          timer_at;          // Deadline asked by curl, 0 if none
+
+  pthread_mutex_t mutex;             // Protects messages and removed
+  pthread_cond_t  removed_cond;      // Signals removed streams
+  std::deque<message> messages;
+  std::set<int>   removed;           // Streams removed by the loop, for removeStream
+  int             next_stream_id;
+
+  // Loop thread only
+  std::map<const void*, std::deque<transfer*> > lanes;   // Front is running
+  std::map<int, transfer*> streams;
+  std::deque<transfer*> delayed;    // Batched requests waiting for start_at
+};
+
+#endif
@@ -0,0 +1,584 @@
+/****************************************************************************\
+ *  AxisSim                                                                 *
+ *  A loopback simulator of the Axis 214 VAPIX interface                    *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  Serves N simulated cameras on 127.0.0.1, camera i on port base+i:       *
+ *    /axis-cgi/mjpg/video.cgi   multipart MJPEG stream                     *
+ *    /axis-cgi/com/ptz.cgi      absolute and continuous moves, zoom and    *
+ *                               query=position, with a speed limited       *
+ *                               motion model and an optional round trip    *
+ *  So CameraAxis and PtzAxis (and AxisLoad) can run without a camera,      *
+ *  e.g. with ip "127.0.0.1:8000" in the configure file.                    *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <string>
+
+using std::string;
+
+#define DEFAULT_PORT          8000
+#define DEFAULT_FPS           25
+#define DEFAULT_WIDTH         768
+#define DEFAULT_HEIGHT        576
+#define DEFAULT_PT_SPEED      100.0    // degree/s at speed 100
+#define DEFAULT_ZOOM_SPEED    5000.0   // zoom units/s at speed 100
+#define BOUNDARY              "myboundary"
+
+#define PAN_MIN   -170.0
+#define PAN_MAX    170.0
+#define TILT_MIN   -90.0
+#define TILT_MAX    30.0
+#define ZOOM_MIN     1.0
+#define ZOOM_MAX  9999.0
+
+// Options shared by all the simulated cameras
+typedef struct _sim_options {
+  int    cameras;          // Number of cameras
+  int    port;             // Port of the first camera
+  int    fps;              // Frames per second of the stream
+  int    width;            // Resolution of the stream, gives the frame size
+  int    height;
+  int    chunk;            // Bytes per write() of the stream, 0: a frame per write
+  int    jitter_ms;        // Random +- jitter of the frame period
+  int    disconnect;       // Drop the stream every so many frames, 0: never
+  double pt_speed;         // Pan/tilt speed limit, degree/s
+  double zoom_speed;       // Zoom speed limit, units/s
+  double latency_ms;       // Round trip of the ptz.cgi requests of camera 0
+  double latency_step_ms;  // Added for each further camera
+} sim_options;
+
+static sim_options options;
+static volatile bool running = true;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double clamp(double v, double lo, double hi)
+{
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// Step "from" towards "to" by at most "step"
+static double approach(double from, double to, double step)
+{
+  if (to > from)
+    return (to - from < step) ? to : from + step;
+  return (from - to < step) ? to : from - step;
+}
+
+/////////////////////////////////////////////////////////////
+// Motion model of the PTZ head of one camera
+class SimPtz
+{
+public:
+  SimPtz();
+
+  void move(double pan, double tilt, bool has_pan, bool has_tilt, int speed);
+  void zoom(double zoom, int speed);
+  void continuousMove(int pan, int tilt);
+  void continuousZoom(int zoom);
+  string position();
+  // Stamp the arrival of a command, reported by position()
+  void received();
+
+  unsigned long commands;     // Commands received
+  unsigned long queries;      // Position queries received
+
+private:
+  // Advance the model to the current time, mutex held
+  void update();
+
+  pthread_mutex_t mutex;
+  double pan, tilt, zoomv;             // Current pose
+  double tpan, ttilt, tzoom;           // Targets of the absolute moves
+  double vpan, vtilt, vzoom;           // Continuous speeds, -1..1 of the limit
+  double speed_pt, speed_zoom;         // Speed of the absolute moves, 0..1 of the limit
+  bool   continuous_pt, continuous_zoom;
+  double last;                         // Time of the last update
+  double last_command;                 // Arrival of the last command, CLOCK_MONOTONIC
+};
+
+SimPtz::SimPtz()
+{
+  pthread_mutex_init(&mutex, NULL);
+  pan = tilt = tpan = ttilt = 0;
+  zoomv = tzoom = ZOOM_MIN;
+  vpan = vtilt = vzoom = 0;
+  speed_pt = speed_zoom = 1;
+  continuous_pt = continuous_zoom = false;
+  commands = queries = 0;
+  last = now();
+  last_command = 0;
+}
+
+void SimPtz::update()
+{
+  double t  = now();
+  double dt = t - last;
+  last = t;
+
+  if (continuous_pt) {
+    pan  = clamp(pan  + vpan  * options.pt_speed * dt, PAN_MIN, PAN_MAX);
+    tilt = clamp(tilt + vtilt * options.pt_speed * dt, TILT_MIN, TILT_MAX);
+  }
+  else {
+    pan  = approach(pan,  tpan,  speed_pt * options.pt_speed * dt);
+    tilt = approach(tilt, ttilt, speed_pt * options.pt_speed * dt);
+  }
+
+  if (continuous_zoom)
+    zoomv = clamp(zoomv + vzoom * options.zoom_speed * dt, ZOOM_MIN, ZOOM_MAX);
+  else
+    zoomv = approach(zoomv, tzoom, speed_zoom * options.zoom_speed * dt);
+}
+
+void SimPtz::move(double p, double t, bool has_pan, bool has_tilt, int speed)
+{
+  pthread_mutex_lock(&mutex);
+  update();
+  if (continuous_pt) {
+    // Leaving continuous mode: the unset axis stays where it is
+    tpan = pan;
+    ttilt = tilt;
+    continuous_pt = false;
+  }
+  if (has_pan)
+    tpan = clamp(p, PAN_MIN, PAN_MAX);
+  if (has_tilt)
+    ttilt = clamp(t, TILT_MIN, TILT_MAX);
+  speed_pt = clamp(speed, 1, 100) / 100.0;
+  pthread_mutex_unlock(&mutex);
+}
+
+void SimPtz::zoom(double z, int speed)
+{
+  pthread_mutex_lock(&mutex);
+  update();
+  tzoom = clamp(z, ZOOM_MIN, ZOOM_MAX);
+  speed_zoom = clamp(speed, 1, 100) / 100.0;
+  continuous_zoom = false;
+  pthread_mutex_unlock(&mutex);
+}
+
+void SimPtz::continuousMove(int p, int t)
+{
+  pthread_mutex_lock(&mutex);
+  update();
+  vpan  = clamp(p, -100, 100) / 100.0;
+  vtilt = clamp(t, -100, 100) / 100.0;
+  continuous_pt = true;
+  pthread_mutex_unlock(&mutex);
+}
+
+void SimPtz::continuousZoom(int z)
+{
+  pthread_mutex_lock(&mutex);
+  update();
+  vzoom = clamp(z, -100, 100) / 100.0;
+  continuous_zoom = true;
+  pthread_mutex_unlock(&mutex);
+}
+
+string SimPtz::position()
+{
+  char reply[160];
+  pthread_mutex_lock(&mutex);
+  update();
+  queries++;
+  // "lastcommand" is not VAPIX, it lets axisload see when commands arrived
+  snprintf(reply, sizeof(reply), "pan=%.4f\ntilt=%.4f\nzoom=%d\nautofocus=on\nlastcommand=%.6f\n",
+	   pan, tilt, (int)(zoomv + 0.5), last_command);
+  pthread_mutex_unlock(&mutex);
+  return reply;
+}
+
+void SimPtz::received()
+{
+  pthread_mutex_lock(&mutex);
+  last_command = now();
+  pthread_mutex_unlock(&mutex);
+}
+
+/////////////////////////////////////////////////////////////
+// One simulated camera: a listening socket and its PTZ head
+typedef struct _sim_camera {
+  int           index;
+  int           listen_fd;
+  SimPtz        ptz;
+  double        latency;      // Round trip of the ptz.cgi requests, s
+  unsigned long frames;       // Frames sent, all clients
+  unsigned long streams;      // Stream connections served
+} sim_camera;
+
+typedef struct _sim_client {
+  sim_camera*   camera;
+  int           fd;
+} sim_client;
+
+// write() all of "buf", false when the client is gone
+static bool send_all(int fd, const void* buf, size_t len)
+{
+  const char* p = (const char*)buf;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool send_reply(int fd, int code, const char* status, const string& body, bool keep_alive)
+{
+  char header[256];
+  int n = snprintf(header, sizeof(header),
+		   "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\n"
+		   "Content-Length: %d\r\nConnection: %s\r\n\r\n",
+		   code, status, (int)body.size(), keep_alive ? "keep-alive" : "close");
+  return send_all(fd, header, n) && send_all(fd, body.data(), body.size());
+}
+
+// Value of "key=" in a query string, NULL when missing
+static const char* param(const string& query, const char* key, string& value)
+{
+  string k = string(key) + "=";
+  size_t pos = 0;
+  while ((pos = query.find(k, pos)) != string::npos) {
+    if (pos == 0 || query[pos-1] == '&') {
+      size_t end = query.find('&', pos);
+      value = query.substr(pos + k.size(), end == string::npos ? string::npos : end - pos - k.size());
+      return value.c_str();
+    }
+    pos += k.size();
+  }
+  return NULL;
+}
+
+static bool serve_ptz(sim_client* client, const string& query, bool keep_alive)
+{
+  SimPtz& ptz = client->camera->ptz;
+  string v, p, t;
+
+  // A far camera: half the round trip for the request to come, half for
+  // the answer to go back
+  useconds_t half = (useconds_t)(client->camera->latency / 2 * 1e6);
+  if (half > 0)
+    usleep(half);
+
+  if (param(query, "query", v)) {
+    string reply = v == "position" ? ptz.position() : "Error: unsupported query\n";
+    if (half > 0)
+      usleep(half);
+    return send_reply(client->fd, 200, "OK", reply, keep_alive);
+  }
+
+  ptz.received();
+  __sync_fetch_and_add(&ptz.commands, 1);
+
+  int speed = param(query, "speed", v) ? atoi(v.c_str()) : 100;
+  bool has_pan  = param(query, "pan", p) != NULL;
+  bool has_tilt = param(query, "tilt", t) != NULL;
+  if (has_pan || has_tilt)
+    ptz.move(atof(p.c_str()), atof(t.c_str()), has_pan, has_tilt, speed);
+  if (param(query, "zoom", v))
+    ptz.zoom(atof(v.c_str()), speed);
+  if (param(query, "continuouspantiltmove", v)) {
+    int cp = 0, ct = 0;
+    sscanf(v.c_str(), "%d,%d", &cp, &ct);
+    ptz.continuousMove(cp, ct);
+  }
+  if (param(query, "continuouszoommove", v))
+    ptz.continuousZoom(atoi(v.c_str()));
+
+  // The camera answers commands with an empty body
+  if (half > 0)
+    usleep(half);
+  return send_reply(client->fd, 204, "No Content", "", keep_alive);
+}
+
+// Stream until the client leaves, returns when the connection must be closed
+static void serve_video(sim_client* client, const string& query)
+{
+  string v;
+  int fps    = param(query, "fps", v) ? atoi(v.c_str()) : options.fps;
+  int width  = options.width;
+  int height = options.height;
+  if (param(query, "resolution", v))
+    sscanf(v.c_str(), "%dx%d", &width, &height);
+  if (fps <= 0)
+    fps = options.fps;
+
+  const char header[] =
+    "HTTP/1.0 200 OK\r\nCache-Control: no-cache\r\nPragma: no-cache\r\n"
+    "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n\r\n";
+  if (!send_all(client->fd, header, sizeof(header) - 1))
+    return;
+
+  __sync_fetch_and_add(&client->camera->streams, 1);
+
+  // A compressed frame is roughly 0.1 bytes per pixel: the body is random
+  // filler without 0xFF, so the only markers are the ones below
+  size_t jpeg_size = (size_t)width * height / 10;
+  if (jpeg_size < 64)
+    jpeg_size = 64;
+  string frame;
+  unsigned int seed = client->fd;
+  unsigned long sent = 0;
+  double period = 1.0 / fps;
+  double next = now();
+
+  while (running) {
+    // Timestamp in a COM segment so a client can measure the latency
+    char stamp[32];
+    int stamp_len = snprintf(stamp, sizeof(stamp), "t=%.6f", now());
+
+    char part[128];
+    int part_len = snprintf(part, sizeof(part),
+			    "--" BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %d\r\n\r\n",
+			    (int)jpeg_size);
+    frame.assign(part, part_len);
+    frame += "\xFF\xD8\xFF\xFE";
+    frame += (char)((stamp_len + 2) >> 8);
+    frame += (char)((stamp_len + 2) & 0xFF);
+    frame.append(stamp, stamp_len);
+    size_t filler = jpeg_size - (frame.size() - part_len) - 2;
+    for (size_t i = 0; i < filler; i++)
+      frame += (char)(rand_r(&seed) % 0xFF);
+    frame += "\xFF\xD9\r\n";
+
+    size_t chunk = options.chunk > 0 ? (size_t)options.chunk : frame.size();
+    for (size_t pos = 0; pos < frame.size(); pos += chunk) {
+      size_t n = frame.size() - pos < chunk ? frame.size() - pos : chunk;
+      if (!send_all(client->fd, frame.data() + pos, n))
+	return;
+    }
+    __sync_fetch_and_add(&client->camera->frames, 1);
+
+    if (options.disconnect > 0 && ++sent % options.disconnect == 0)
+      return;
+
+    // Keep the average rate, each period jittered by +- jitter_ms
+    next += period;
+    double wait = next - now();
+    if (options.jitter_ms > 0)
+      wait += ((rand_r(&seed) % (2 * options.jitter_ms + 1)) - options.jitter_ms) / 1000.0;
+    if (wait > 0)
+      usleep((useconds_t)(wait * 1e6));
+    else if (wait < -1.0)
+      next = now();            // Far behind, do not burst to catch up
+  }
+}
+
+static void* client_thread(void* ptr)
+{
+  sim_client* client = (sim_client*)ptr;
+  string request;
+  char buf[4096];
+
+  // Serve requests on the connection until the client or a stream closes it
+  while (running) {
+    size_t end;
+    while ((end = request.find("\r\n\r\n")) == string::npos) {
+      ssize_t n = recv(client->fd, buf, sizeof(buf), 0);
+      if (n <= 0)
+	goto done;
+      request.append(buf, n);
+    }
+
+    {
+      string head = request.substr(0, end);
+      request.erase(0, end + 4);
+
+      char method[16], target[1024], version[16];
+      if (sscanf(head.c_str(), "%15s %1023s %15s", method, target, version) != 3)
+	break;
+
+      // Same rules as HTTP: 1.1 keeps the connection unless asked not to
+      bool keep_alive = strcmp(version, "HTTP/1.1") == 0 &&
+	head.find("Connection: close") == string::npos;
+
+      string path  = target;
+      string query;
+      size_t q = path.find('?');
+      if (q != string::npos) {
+	query = path.substr(q + 1);
+	path  = path.substr(0, q);
+      }
+
+      if (path == "/axis-cgi/mjpg/video.cgi") {
+	serve_video(client, query);
+	break;
+      }
+      else if (path == "/axis-cgi/com/ptz.cgi") {
+	if (!serve_ptz(client, query, keep_alive) || !keep_alive)
+	  break;
+      }
+      else {
+	send_reply(client->fd, 404, "Not Found", "", false);
+	break;
+      }
+    }
+  }
+
+ done:
+  close(client->fd);
+  delete client;
+  return NULL;
+}
+
+static void* accept_thread(void* ptr)
+{
+  sim_camera* camera = (sim_camera*)ptr;
+
+  while (running) {
+    int fd = accept(camera->listen_fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sim_client* client = new sim_client;
+    client->camera = camera;
+    client->fd = fd;
+    pthread_t thread;
+    pthread_create(&thread, NULL, client_thread, client);
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+static void stop(int)
+{
+  running = false;
+}
+
+static void usage()
+{
+  fprintf(stderr,
+	  "usage: axissim [options]\n"
+	  "  -n cameras     number of simulated cameras (1)\n"
+	  "  -p port        port of the first camera, the others follow (%d)\n"
+	  "  -f fps         frames per second of the stream (%d)\n"
+	  "  -r WxH         resolution, sets the frame size (%dx%d)\n"
+	  "  -c bytes       write the stream in chunks of this size (whole frames)\n"
+	  "  -j ms          random jitter of the frame period (0)\n"
+	  "  -d frames      drop the stream connection every so many frames (never)\n"
+	  "  -s deg/s       pan/tilt speed limit (%.0f)\n"
+	  "  -z units/s     zoom speed limit (%.0f)\n"
+	  "  -l ms          round trip of the ptz.cgi requests (0)\n"
+	  "  -L ms          added to the round trip for each further camera (0)\n",
+	  DEFAULT_PORT, DEFAULT_FPS, DEFAULT_WIDTH, DEFAULT_HEIGHT,
+	  DEFAULT_PT_SPEED, DEFAULT_ZOOM_SPEED);
+  exit(1);
+}
+
+int main(int argc, char** argv)
+{
+  options.cameras    = 1;
+  options.port       = DEFAULT_PORT;
+  options.fps        = DEFAULT_FPS;
+  options.width      = DEFAULT_WIDTH;
+  options.height     = DEFAULT_HEIGHT;
+  options.chunk      = 0;
+  options.jitter_ms  = 0;
+  options.disconnect = 0;
+  options.pt_speed   = DEFAULT_PT_SPEED;
+  options.zoom_speed = DEFAULT_ZOOM_SPEED;
+  options.latency_ms      = 0;
+  options.latency_step_ms = 0;
+
+  int c;
+  while ((c = getopt(argc, argv, "n:p:f:r:c:j:d:s:z:l:L:h")) != -1) {
+    switch (c) {
+    case 'n': options.cameras    = atoi(optarg); break;
+    case 'p': options.port       = atoi(optarg); break;
+    case 'f': options.fps        = atoi(optarg); break;
+    case 'r':
+      if (sscanf(optarg, "%dx%d", &options.width, &options.height) != 2)
+	usage();
+      break;
+    case 'c': options.chunk      = atoi(optarg); break;
+    case 'j': options.jitter_ms  = atoi(optarg); break;
+    case 'd': options.disconnect = atoi(optarg); break;
+    case 's': options.pt_speed   = atof(optarg); break;
+    case 'z': options.zoom_speed = atof(optarg); break;
+    case 'l': options.latency_ms      = atof(optarg); break;
+    case 'L': options.latency_step_ms = atof(optarg); break;
+    default:  usage();
+    }
+  }
+  if (options.cameras < 1 || options.fps < 1)
+    usage();
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  sim_camera* cameras = new sim_camera[options.cameras];
+  for (int i = 0; i < options.cameras; i++) {
+    sim_camera* camera = &cameras[i];
+    camera->index   = i;
+    camera->frames  = 0;
+    camera->streams = 0;
+    camera->latency = (options.latency_ms + i * options.latency_step_ms) / 1000;
+
+    camera->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(camera->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(options.port + i);
+    if (bind(camera->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+	listen(camera->listen_fd, 64) < 0) {
+      fprintf(stderr, "AxisSim: cannot listen on port %d\n", options.port + i);
+      return 1;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, accept_thread, camera);
+    pthread_detach(thread);
+  }
+
+  printf("AxisSim: %d camera(s) on 127.0.0.1:%d-%d, %d fps %dx%d\n",
+	 options.cameras, options.port, options.port + options.cameras - 1,
+	 options.fps, options.width, options.height);
+  fflush(stdout);
+
+  while (running)
+    pause();
+
+  for (int i = 0; i < options.cameras; i++)
+    printf("AxisSim: camera %d: %lu frames, %lu streams, %lu ptz commands, %lu queries\n",
+	   i, cameras[i].frames, cameras[i].streams,
+	   cameras[i].ptz.commands, cameras[i].ptz.queries);
+  return 0;
+}
@@ -0,0 +1,182 @@
+/****************************************************************************\
+ *  CameraAxis version 0.1a                                                 *
+ *  A Camera Plugin Driver for the Player/Stage robot server                *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  The camera device of the Axis 214, see CameraAxisDevice.h               *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "CameraAxisDevice.h"
+
+#define CAMERA_RECONNECT_USEC 500000             // Wait before reconnecting a dropped stream
+
+CameraAxisDevice::CameraAxisDevice(const char* url)
+{
+  camera_url = url;
+  max_Q_size = MAX_Q_SIZE;
+  Q_size     = 0;
+  dropped    = 0;
+  buffer = NULL;
+  buffersize = 0;
+  bufferposition = 0;
+  state  = 0;
+  lastbyte = 0;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&frame_cond, NULL);
+
+  puts("CameraAxisDevice: Starting CURL connection...");
+  reactor = AxisReactor::acquire();
+  stream  = reactor->addStream(camera_url, &CameraAxisDevice::grab_frame,
+			       &CameraAxisDevice::stream_ended, this, CAMERA_RECONNECT_USEC);
+}
+
+CameraAxisDevice::~CameraAxisDevice()
+{
+  // Once removed, grab_frame is not called anymore
+  reactor->removeStream(stream);
+  AxisReactor::release();
+  puts("CameraAxisDevice: CURL connection cleaned up.");
+
+  // Release the frames nobody read
+  while (!Q.empty()) {
+    free(Q.front().image);
+    Q.pop();
+  }
+  free(buffer);
+  pthread_cond_destroy(&frame_cond);
+  pthread_mutex_destroy(&mutex);
+}
+
+bool CameraAxisDevice::framesWaiting()
+{
+  return !Q.empty();
+}
+
+bool CameraAxisDevice::waitFrame(long timeout_usec)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec  += timeout_usec / 1000000;
+  deadline.tv_nsec += (timeout_usec % 1000000) * 1000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  // Not cancelled while holding the mutex, the caller tests for it between waits
+  int oldstate;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+  pthread_mutex_lock(&mutex);
+  while (Q.empty())
+    if (pthread_cond_timedwait(&frame_cond, &mutex, &deadline) != 0)
+      break;
+  bool waiting = !Q.empty();
+  pthread_mutex_unlock(&mutex);
+  pthread_setcancelstate(oldstate, NULL);
+  return waiting;
+}
+
+queuedframe CameraAxisDevice::dequeue()
+{
+  pthread_mutex_lock(&mutex);
+  queuedframe f = Q.front();
+  Q.pop();
+  Q_size--;
+  pthread_mutex_unlock(&mutex);
+  return f;
+}
+
+void CameraAxisDevice::stream_ended(void *data, bool, const std::string&)
+{
+  CameraAxisDevice* me = (CameraAxisDevice*) data;
+  me->state = 0;
+  me->lastbyte = 0;
+}
+
+void CameraAxisDevice::store(uint8_t byte)
+{
+  if (bufferposition == buffersize) {
+    buffersize = (buffersize == 0) ? 65536 : buffersize * 2;
+    buffer = (uint8_t*)realloc((void*)buffer, buffersize);
+  }
+  buffer[bufferposition++] = byte;
+}
+
+size_t CameraAxisDevice::grab_frame(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  CameraAxisDevice* me = (CameraAxisDevice*) data;
+
+  size_t realsize = size * nmemb;
+
+  // Tags are searched against the previous byte, which may come from the
+  // previous chunk: CURL does not deliver the stream aligned to frames
+  for(size_t i=0; i<(realsize); i++) {
+
+    uint8_t presentbyte = ((uint8_t *)ptr)[i];
+
+    switch( me->state ) {
+
+    case 0:         // frame not started: search for start tag FFD8
+      if( me->lastbyte == 0xFF && presentbyte == 0xD8 ) {
+	me->bufferposition = 0;
+	me->store(0xFF);
+	me->store(presentbyte);
+	me->state = 1;
+      }
+      break;
+
+    case 1:         // frame started: search for end tag FFD9
+      me->store(presentbyte);
+
+      if( me->lastbyte == 0xFF && presentbyte == 0xD9 ) {
+	// build the frame and push it to the queue
+	queuedframe f = {(uint32_t)me->bufferposition, me->buffer};
+	me->enqueue(f);
+
+	// the buffer memory is kept for the next frame
+	me->bufferposition = 0;
+	me->state = 0;
+	presentbyte = 0;
+      }
+      break;
+
+    default:
+      // this should never be reached
+      break;
+    }
+    me->lastbyte = presentbyte;
+  }
+  return realsize;
+}
+
+void CameraAxisDevice::enqueue(queuedframe f)
+{
+  if (Q_size < max_Q_size) {
+    // Deep copy from "f" to "image"
+    // Because the memory of "f" is reused for the next frame, see: CameraAxisDevice::grab_frame()
+    // Dont forget to release "image" after dequeue, see: CameraAxis::Main()
+    uint8_t* image = (uint8_t*)malloc(f.image_count);
+    memcpy(image, f.image, f.image_count);
+    queuedframe frame = {f.image_count, image};
+    pthread_mutex_lock(&mutex);
+    Q.push(frame);
+    Q_size++;
+    pthread_cond_signal(&frame_cond);
+    pthread_mutex_unlock(&mutex);
+  }
+  else
+    dropped++;
+}
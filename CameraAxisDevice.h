@@ -0,0 +1,85 @@
+/****************************************************************************\
+ *  CameraAxis version 0.1a                                                 *
+ *  A Camera Plugin Driver for the Player/Stage robot server                *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  The camera device of the Axis 214: grabs the MJPEG stream of the        *
+ *  camera and cuts it into jpeg frames. Kept free of Player so it can      *
+ *  also be linked into the load test (see AxisLoad.cc).                    *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#ifndef CAMERA_AXIS_DEVICE_H
+#define CAMERA_AXIS_DEVICE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <queue>
+
+#include "AxisReactor.h"
+
+#define MAX_Q_SIZE         5
+
+typedef struct _queuedframe {
+  uint32_t image_count;    // Size of the image data
+  uint8_t* image;          // Image data
+} queuedframe;
+typedef std::queue<queuedframe> framesqueue;
+
+/////////////////////////////////////////////////////////////
+// Class of the camera device
+class CameraAxisDevice
+{
+public:
+  CameraAxisDevice(const char* url);
+  ~CameraAxisDevice();
+
+  // Check any frames in Q
+  bool            framesWaiting();
+  // Wait up to timeout_usec for a frame in Q, true if there is one
+  bool            waitFrame(long timeout_usec);
+  // Read a frame from the framesqueue (Q)
+  queuedframe     dequeue();
+  // Number of frames dropped because the Q was full
+  unsigned long   framesDropped() { return dropped; }
+
+private:
+  const char*     camera_url;      // Url of the camera
+  AxisReactor*    reactor;         // Shared I/O thread carrying the stream
+  int             stream;          // Id of the stream in the reactor
+  pthread_mutex_t mutex;           // Mutex to protect shared framesqueue(Q)
+  pthread_cond_t  frame_cond;      // Signals a new frame in Q
+
+  framesqueue     Q;               // Queue of frames, for both reading and writing
+  int             Q_size;          // Size of the queue
+  int             max_Q_size;      // Capacity of the queue
+  unsigned long   dropped;         // Frames dropped on a full queue
+
+  // State of grab_frame, one per device so several cameras can share a process
+  uint8_t*        buffer;          // The bytes grabed by CURL, to build the jpeg
+  size_t          buffersize;      // Size of the buffer (allocated memory)
+  size_t          bufferposition;  // The write position in the buffer
+  uint8_t         state;           // The state of the fsm
+  uint8_t         lastbyte;        // Last byte of the previous chunk, tags may be split
+
+  // The responsing function for CURL, run on the reactor thread
+  static size_t   grab_frame(void *ptr, size_t size, size_t nmemb, void *data);
+  // Reset the fsm when the stream drops, the next one starts anew
+  static void     stream_ended(void *data, bool, const std::string&);
+
+  // Append a byte to the frame being built
+  void            store(uint8_t byte);
+
+  // Write a new frame into the framesqueue(Q)
+  void            enqueue(queuedframe f);
+};
+
+#endif
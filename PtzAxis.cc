@@ -32,178 +32,20 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <string>
 
 #include <pthread.h>
-#include <curl/curl.h>
+#include <string>
+#include <vector>
 
 #include <libplayercore/playercore.h>
 
+#include "PtzAxisDevice.h"
+#include "PtzAxisController.h"
+#include "PtzAxisGroup.h"
+
 #define DEFAULT_PTZ_SPEED   90
 #define PTZ_SLEEP_TIME_USEC 10000                // 100 Hz
 
-typedef struct _ptz_state {
-  float pan;               // degree
-  float tilt;              // degree
-  int   zoom;              // device specified 
-} ptz_state;
-
-// Class of the PTZ device
-class PtzAxisDevice
-{
-public:
-  PtzAxisDevice(string);
-  ~PtzAxisDevice();
-  
-  // Interface for controling
-  bool move(float pan, float tilt, int speed);             // Absolute position move
-  bool continuousMove(int pan, int tilt, int speed);       // Continuous move
-  bool zoom(int zoom);                                     // Continuous move
-
-  // Interface for querying
-  bool updateState();                            // Update the ptz_state of the device
-  ptz_state state;                               // The ptz_state of the device
-
-protected:
-  // Tool function of updateState
-  static size_t stateParser(void *ptr, size_t size, size_t nmemb, void *data);
-
-  // Internal data
-  string ptz_ip;                                 // Ip of the camera
-  string ptz_cmd_prefix;                         // For wrapping command
-
-};
-
-PtzAxisDevice::PtzAxisDevice(string ip)
-{
-  puts("PtzAxisDevice: Start device");
-  ptz_ip = ip;
-  ptz_cmd_prefix = ptz_ip.append("/axis-cgi/com/ptz.cgi?");
-}
-
-PtzAxisDevice::~PtzAxisDevice()
-{
-  puts("PtzAxisDevice: Device closed");
-}
-
-bool PtzAxisDevice::move(float pan, float tilt, int speed)
-{
-  // Move the camera to a specified PT position
-  string ptz_cmd; 
-  CURL*  ptz_curl = curl_easy_init();
-  char   ptz_cmd_suffix[64];
-  int n = sprintf(ptz_cmd_suffix, "pan=%.1f&tilt=%.1f&speed=%d&autofocus=on",
-		  pan, tilt, speed);
-  ptz_cmd = ptz_cmd_prefix;
-  ptz_cmd.append(ptz_cmd_suffix, n);
-  
-  curl_easy_setopt(ptz_curl, CURLOPT_URL, ptz_cmd.c_str());
-  curl_easy_perform(ptz_curl);
-  
-  curl_easy_cleanup(ptz_curl); 
-
-  puts("command:");
-  puts(ptz_cmd.c_str());
-
-  return 0;
-}
-
-//
-// Execute a continuous pan/tilt/zoom move.  The three inputs are
-// assumed to be speeds, the combination of which constitute the
-// vector in which the camera is moving in p/t/z.
-//
-bool PtzAxisDevice::continuousMove(int pan, int tilt, int zoom)
-{
-  string ptz_cmd; 
-  CURL*  ptz_curl = curl_easy_init();
-  char   ptz_cmd_suffix[64];
-  int n = sprintf(ptz_cmd_suffix, "continuouspantiltmove=%d,%d&continuouszoommove=%d", pan, tilt, zoom);
-  ptz_cmd = ptz_cmd_prefix;
-  ptz_cmd.append(ptz_cmd_suffix, n);
-  
-  curl_easy_setopt(ptz_curl, CURLOPT_URL, ptz_cmd.c_str());
-  curl_easy_perform(ptz_curl);
-  
-  curl_easy_cleanup(ptz_curl); 
-
-  puts("command:");
-  puts(ptz_cmd.c_str());
-
-  return 0;
-}
-
-bool PtzAxisDevice::zoom(int zoom)
-{
-  // Zoom the camera to a specified value
-  string ptz_cmd; 
-  CURL*  ptz_curl = curl_easy_init();
-  char   ptz_cmd_suffix[64];
-  int n = sprintf(ptz_cmd_suffix, "zoom=%d&autofocus=on", zoom);
-  ptz_cmd = ptz_cmd_prefix;
-  ptz_cmd.append(ptz_cmd_suffix, n);
-  
-  curl_easy_setopt(ptz_curl, CURLOPT_URL, ptz_cmd.c_str());
-  curl_easy_perform(ptz_curl);
-  
-  curl_easy_cleanup(ptz_curl); 
-  
-  puts("command:");
-  puts(ptz_cmd.c_str());
-
-  return 0;
-}
-
-bool PtzAxisDevice::updateState()
-{
-  string ptz_cmd;                      
-  CURL*  ptz_curl = curl_easy_init();
-  char   ptz_cmd_suffix[] = "query=position";
-  ptz_cmd = ptz_cmd_prefix;
-  ptz_cmd.append(ptz_cmd_suffix, strlen(ptz_cmd_suffix));
-
-  curl_easy_setopt(ptz_curl, CURLOPT_URL, ptz_cmd.c_str());
-  curl_easy_setopt(ptz_curl, CURLOPT_WRITEFUNCTION, &PtzAxisDevice::stateParser);
-  curl_easy_setopt(ptz_curl, CURLOPT_WRITEDATA, &state);
-
-  curl_easy_perform(ptz_curl);
-  curl_easy_cleanup(ptz_curl); 
-
-  return 0;
-}
-
-size_t PtzAxisDevice::stateParser(void *ptr, size_t size, size_t nmemb, void *data)
-{
-  ptz_state* state = (ptz_state*) data;
-  
-  if(strstr((char*)ptr, "Error"))
-    puts("error");
-  else {
-    char* pan  = strstr((char*)ptr, "pan=") + 4;
-    char* tilt = strstr((char*)ptr, "tilt=") + 5;
-    char* zoom = strstr((char*)ptr, "zoom=") + 5;
-    pan[strchr(pan, '\n')-pan]    = '\0';
-    tilt[strchr(tilt, '\n')-tilt] = '\0';
-    zoom[strchr(zoom, '\n')-zoom] = '\0';
-    
-    state->pan  = atof(pan);
-    state->tilt = atof(tilt);
-    state->zoom = atoi(zoom);
-  }
-  return (size*nmemb);
-}
-
-
-/////////////////////////////////////// PART TWO ///////////////////////////////////////
-
-// This stucture is used to pass information about the command 
-// to the new thread excuting the command
-typedef struct _driver_ptz_cmd {
-  PtzAxisDevice*   ptz;       // The device
-  player_ptz_cmd_t cmd;       // The command (p,t,z,ps,ts)
-  int              zoom;      // Current zoom of the device
-} driver_ptz_cmd;
-
 // Class of the PTZ driver
 class PtzAxis : public Driver
 {
@@ -217,21 +59,28 @@ public:
   
   // Message Handler
   int          ProcessMessage(QueuePointer &resp_queue, player_msghdr* hdr, void* data);
-  static void* ExecuteCommand(void *ptr);   // This will be run in a new thread
-  static void* ExecuteContinuousCommand(void *ptr);   // This too, for continuous
-  static       pthread_mutex_t mutex; 
   
 private:
   PtzAxisDevice*    Axis214;    // The ptz device
   char              ptz_ip[64]; // IP address of the ptz device
+  player_devaddr_t  ptz_addr;   // The ptz interface, of the device or of the group
+
+  // Group mode, with several "ips": the commands go to all the cameras,
+  // ptz_addr publishes the first one and member_addrs (optional) each one
+  std::vector<std::string>      group_ips;
+  std::vector<player_devaddr_t> member_addrs;
+  PtzAxisGroup*     group;
+
+  // Optional closed-loop position control, see PtzAxisController.h
+  bool                  use_controller;
+  ptz_controller_config controller_config;
+  PtzAxisController*    controller;
   
   player_ptz_cmd_t* cmd;        // Command received from player
   player_ptz_data_t data;       // Data to be published to player
   int _mode;
 };
 
-pthread_mutex_t PtzAxis::mutex; 
-
 // Plugin driver routines: PtzAxis_Init
 //                         PtzAxis_Register
 //                         player_driver_init
@@ -262,16 +111,75 @@ extern "C" {
 //   PtzAxis::Shutdown()       // When last subscriber left
 
 PtzAxis::PtzAxis(ConfigFile* cf, int section) 
-  : Driver(cf, section, true, PLAYER_MSGQUEUE_DEFAULT_MAXLEN, PLAYER_PTZ_CODE)
+  : Driver(cf, section, true, PLAYER_MSGQUEUE_DEFAULT_MAXLEN)
 {
+  Axis214 = NULL;
+  group   = NULL;
+
+  // The first ptz interface is the device (or the group)...
+  if (cf->ReadDeviceAddr(&ptz_addr, section, "provides", PLAYER_PTZ_CODE, -1, NULL) != 0 ||
+      AddInterface(ptz_addr) != 0) {
+    SetError(-1);
+    return;
+  }
+
   strncpy(ptz_ip, cf->ReadString(section, "ip", DEFAULT_PTZ_IP),
 	  sizeof(ptz_ip));
+  _mode = PLAYER_PTZ_POSITION_CONTROL;
+
+  for (int i = 0; i < cf->GetTupleCount(section, "ips"); i++)
+    group_ips.push_back(cf->ReadTupleString(section, "ips", i, ""));
+
+  // ...and in group mode the next ones, if any, are the members
+  for (int i = 1; i <= (int)group_ips.size() && i < cf->GetTupleCount(section, "provides"); i++) {
+    player_devaddr_t addr;
+    if (cf->ReadDeviceAddr(&addr, section, "provides", PLAYER_PTZ_CODE, i, NULL) != 0)
+      break;
+    if (AddInterface(addr) != 0) {
+      SetError(-1);
+      return;
+    }
+    member_addrs.push_back(addr);
+  }
+
+  // Position commands go through the controller instead of absolute moves
+  use_controller = cf->ReadInt(section, "controller", 0) != 0;
+  controller_config = PtzAxisController::defaults();
+  controller_config.rate        = cf->ReadFloat(section, "controller_rate",        controller_config.rate);
+  controller_config.poll_rate   = cf->ReadFloat(section, "controller_poll_rate",   controller_config.poll_rate);
+  controller_config.kp          = cf->ReadFloat(section, "controller_kp",          controller_config.kp);
+  controller_config.ki          = cf->ReadFloat(section, "controller_ki",          controller_config.ki);
+  controller_config.kd          = cf->ReadFloat(section, "controller_kd",          controller_config.kd);
+  controller_config.kf          = cf->ReadFloat(section, "controller_kf",          controller_config.kf);
+  controller_config.max_speed   = cf->ReadFloat(section, "controller_max_speed",   controller_config.max_speed);
+  controller_config.max_accel   = cf->ReadFloat(section, "controller_max_accel",   controller_config.max_accel);
+  controller_config.speed_scale = cf->ReadFloat(section, "controller_speed_scale", controller_config.speed_scale);
+  controller_config.deadband    = cf->ReadFloat(section, "controller_deadband",    controller_config.deadband);
+  controller_config.pan_min     = cf->ReadFloat(section, "controller_pan_min",     controller_config.pan_min);
+  controller_config.pan_max     = cf->ReadFloat(section, "controller_pan_max",     controller_config.pan_max);
+  controller_config.tilt_min    = cf->ReadFloat(section, "controller_tilt_min",    controller_config.tilt_min);
+  controller_config.tilt_max    = cf->ReadFloat(section, "controller_tilt_max",    controller_config.tilt_max);
+  controller = NULL;
+
+  if (!group_ips.empty() && use_controller) {
+    puts("PtzAxis: The controller drives one camera, not used in group mode");
+    use_controller = false;
+  }
 }
 
 int PtzAxis::Setup ()
 {
   puts("PtzAxis: Setting up driver...");  
     
+  if (!group_ips.empty()) {
+    // Open the connections now, the first group command must not wait for them
+    group = new PtzAxisGroup(group_ips);
+    group->warmUp();
+    data.zoom = group->member(0)->state.zoom;
+    StartThread();
+    return 0;
+  }
+
   // Connect to the ptz device
   Axis214 = new PtzAxisDevice(ptz_ip);
 
@@ -279,6 +187,9 @@ int PtzAxis::Setup ()
   Axis214->updateState();
   data.zoom = Axis214->state.zoom;
 
+  if (use_controller)
+    controller = new PtzAxisController(Axis214, controller_config);
+
   // Start the main thread
   StartThread();
 
@@ -292,13 +203,33 @@ void PtzAxis::Main()
 
     ProcessMessages();
 
-    // Publish the PTZ device's state to the server
-    Axis214->updateState();
-    data.pan  = Axis214->state.pan;
-    data.tilt = Axis214->state.tilt;
-    data.zoom = Axis214->state.zoom;
+    // Publish the PTZ device's state to the server, the controller
+    // already polls the camera while following position commands
+    ptz_state state;
+    if (group) {
+      group->updateState();
+      state = group->member(0)->state;
+      for (size_t i = 0; i < member_addrs.size(); i++) {
+	player_ptz_data_t member;
+	memset(&member, 0, sizeof(member));
+	member.pan  = group->member(i)->state.pan;
+	member.tilt = group->member(i)->state.tilt;
+	member.zoom = group->member(i)->state.zoom;
+	Publish(member_addrs[i], PLAYER_MSGTYPE_DATA, PLAYER_PTZ_DATA_STATE,
+		&member, sizeof (player_ptz_data_t), NULL);
+      }
+    }
+    else if (controller && _mode == PLAYER_PTZ_POSITION_CONTROL)
+      state = controller->pose();
+    else {
+      Axis214->updateState();
+      state = Axis214->state;
+    }
+    data.pan  = state.pan;
+    data.tilt = state.tilt;
+    data.zoom = state.zoom;
 
-    Publish(device_addr, PLAYER_MSGTYPE_DATA, PLAYER_PTZ_DATA_STATE,
+    Publish(ptz_addr, PLAYER_MSGTYPE_DATA, PLAYER_PTZ_DATA_STATE,
 	    &data, sizeof (player_ptz_data_t), NULL);
 
     //    printf("Publish:\npan:%.1f, tilt:%.1f, zoom:%d, speed:%d\n", 
@@ -314,7 +245,12 @@ int PtzAxis::Shutdown ()
   puts("\nPtzAxis: Shutting down driver..."); 
   
   StopThread ();
+  delete controller;
+  controller = NULL;
   delete Axis214;
+  Axis214 = NULL;
+  delete group;
+  group = NULL;
   
   return 0;
 }
@@ -324,75 +260,63 @@ int PtzAxis::ProcessMessage(QueuePointer &resp_queue, player_msghdr * hdr, void
   assert (hdr);
   
   // REQ_GENERIC
-  if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ, PLAYER_PTZ_REQ_GENERIC, device_addr))
-    Publish(device_addr, resp_queue, PLAYER_MSGTYPE_RESP_NACK, hdr->subtype);
+  if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ, PLAYER_PTZ_REQ_GENERIC, ptz_addr))
+    Publish(ptz_addr, resp_queue, PLAYER_MSGTYPE_RESP_NACK, hdr->subtype);
   else
     
     // REQ_CONTROL_MODE
-    if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ, PLAYER_PTZ_REQ_CONTROL_MODE, device_addr)) {
-      //      Publish(device_addr, resp_queue, PLAYER_MSGTYPE_RESP_NACK, hdr->subtype);
+    if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_REQ, PLAYER_PTZ_REQ_CONTROL_MODE, ptz_addr)) {
+      //      Publish(ptz_addr, resp_queue, PLAYER_MSGTYPE_RESP_NACK, hdr->subtype);
       player_ptz_req_control_mode* new_mode = reinterpret_cast<player_ptz_req_control_mode*> (data);
       _mode = new_mode->mode;
       fprintf(stderr, "Setting mode to: %d\n", _mode);
-      Publish(device_addr, resp_queue, PLAYER_MSGTYPE_RESP_ACK, hdr->subtype);
+      // Leave the camera to the velocity commands, stopped before the ACK
+      if (controller && _mode != PLAYER_PTZ_POSITION_CONTROL)
+	controller->release();
+      Publish(ptz_addr, resp_queue, PLAYER_MSGTYPE_RESP_ACK, hdr->subtype);
     }
     else
       
       // CMD mode:
-      if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_CMD, PLAYER_PTZ_CMD_STATE, device_addr)) {
+      if (Message::MatchMessage(hdr, PLAYER_MSGTYPE_CMD, PLAYER_PTZ_CMD_STATE, ptz_addr)) {
 	cmd = reinterpret_cast<player_ptz_cmd_t*> (data);
 	
 	printf("Message:\npan:%.1f, tilt:%.1f, zoom:%d, speed:%d\n", 
 	       cmd->pan, cmd->tilt, (int)cmd->zoom, (int)cmd->panspeed);
 
-	// Deep copy the data needed by excuting a command
-	pthread_mutex_lock(&mutex); 
-	driver_ptz_cmd *command = new driver_ptz_cmd;    // Delete in void* PtzAxis::ExecuteCommand(void *ptr)
-	command->ptz  = Axis214;                         
-	command->zoom = this->data.zoom;
-	command->cmd.pan  = cmd->pan;
-	command->cmd.tilt = cmd->tilt;
-	command->cmd.zoom = cmd->zoom;
-	command->cmd.panspeed  = ((int)cmd->panspeed == 0) ? DEFAULT_PTZ_SPEED : (int)cmd->panspeed;
-	command->cmd.tiltspeed = command->cmd.panspeed;
-	pthread_mutex_unlock(&mutex);  	
-		
-	// We have to switch on the mode, since the thread methods are static.
-	pthread_t foo;
-	if (_mode == PLAYER_PTZ_POSITION_CONTROL) {
-	  pthread_create(&foo, NULL, &PtzAxis::ExecuteCommand, (void*)command);
+	// Retargeting the controller is immediate
+	if (controller && _mode == PLAYER_PTZ_POSITION_CONTROL) {
+	  controller->setTarget(cmd->pan, cmd->tilt, (int)cmd->zoom);
+	  return 0;
 	}
-	else {
-	  pthread_create(&foo, NULL, &PtzAxis::ExecuteContinuousCommand, (void*)command);
+
+	int speed = ((int)cmd->panspeed == 0) ? DEFAULT_PTZ_SPEED : (int)cmd->panspeed;
+
+	// One command for all the cameras, fanned out at once; each camera's
+	// answer is printed by the group
+	if (group) {
+	  if (_mode == PLAYER_PTZ_POSITION_CONTROL) {
+	    // Each camera compares with its own zoom, not the published one
+	    group->position(cmd->pan, cmd->tilt, speed, (int)cmd->zoom, false);
+	  }
+	  else
+	    group->continuousMove((int)cmd->pan, (int)cmd->tilt, (int)cmd->zoom, false);
+	  return 0;
+	}
+
+	// Queued to the I/O thread without waiting, the camera still gets
+	// the commands in order
+	if (_mode == PLAYER_PTZ_POSITION_CONTROL) {
+	  // Only excute a zoom action when a different zoom is request
+	  // Because the zoom action will block the camera from excuting other action
+	  if ((int)cmd->zoom != (int)this->data.zoom)
+	    Axis214->zoom((int)cmd->zoom, false);
+	  Axis214->move(cmd->pan, cmd->tilt, speed, false);
 	}
+	else
+	  Axis214->continuousMove((int)cmd->pan, (int)cmd->tilt, (int)cmd->zoom, false);
       }
       else
 	return -1;
   return 0;
 }
-
-// Position control mode...  Run in own thread.
-void* PtzAxis::ExecuteCommand(void *ptr)
-{
-  driver_ptz_cmd* command = (driver_ptz_cmd*) ptr;
-
-  // Only excute a zoom action when a different zoom is request
-  // Because the zoom action will block the camera from excuting other action
-  if ((int)command->cmd.zoom != (int)command->zoom) {
-    command->ptz->zoom((int)command->cmd.zoom);
-  }
-  
-  command->ptz->move(command->cmd.pan, command->cmd.tilt, (int)command->cmd.panspeed);
-  delete command;                      
-  return (NULL);
-}
-
-// Velocity control mode commands.  Run in own thread.
-void* PtzAxis::ExecuteContinuousCommand(void *ptr)
-{
-  driver_ptz_cmd* command = (driver_ptz_cmd*) ptr;
-  command->ptz->continuousMove((int) command->cmd.pan, (int) command->cmd.tilt, (int) command->cmd.zoom);
-  delete command;                      
-  return (NULL);
-}
-
@@ -0,0 +1,304 @@
+/****************************************************************************\
+ *  PtzAxis version 0.1a                                                    *
+ *  A PTZ Plugin Driver for the Player/Stage robot server                   *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  Closed-loop position controller of the Axis 214 PTZ head, see           *
+ *  PtzAxisController.h                                                     *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "PtzAxisController.h"
+
+#define TARGET_TIMEOUT 0.5                       // s, see PtzAxisController::control()
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double clamp(double v, double lo, double hi)
+{
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+ptz_controller_config PtzAxisController::defaults()
+{
+  ptz_controller_config config;
+  config.rate        = 50;
+  config.poll_rate   = 10;
+  config.kp          = 8;
+  config.ki          = 0.5;
+  config.kd          = 0.05;
+  config.kf          = 1.0;
+  config.max_speed   = 90;
+  config.max_accel   = 180;
+  config.speed_scale = 100;
+  config.deadband    = 0.1;
+  config.pan_min     = -170;               // Axis 214
+  config.pan_max     = 170;
+  config.tilt_min    = -90;
+  config.tilt_max    = 30;
+  return config;
+}
+
+PtzAxisController::PtzAxisController(PtzAxisDevice* device, const ptz_controller_config& cfg)
+{
+  ptz    = device;
+  config = cfg;
+  if (config.rate <= 0)
+    config.rate = defaults().rate;
+  if (config.poll_rate <= 0 || config.poll_rate > config.rate)
+    config.poll_rate = config.rate;
+
+  // Start from where the camera is
+  ptz->updateState();
+  axis a = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  pan  = a;
+  tilt = a;
+  pan.min  = config.pan_min;
+  pan.max  = config.pan_max;
+  tilt.min = config.tilt_min;
+  tilt.max = config.tilt_max;
+  pan.target  = pan.estimate  = ptz->state.pan;
+  tilt.target = tilt.estimate = ptz->state.tilt;
+  zoom = zoom_target = zoom_sent = ptz->state.zoom;
+  active   = false;
+  target_time = reference_time = 0;
+  commands = 0;
+  running  = true;
+  polling  = false;
+  poll_sent = 0;
+
+  pthread_mutex_init(&mutex, NULL);
+  pthread_create(&control_thread, NULL, &PtzAxisController::start_control_thread, (void*)this);
+  printf("PtzAxisController: Control loop started at %.0f Hz, polling at %.0f Hz\n",
+	 config.rate, config.poll_rate);
+}
+
+PtzAxisController::~PtzAxisController()
+{
+  running = false;
+  pthread_join(control_thread, NULL);
+  while (polling)              // pollDone() still holds "this"
+    usleep(1000);
+  if (pan.sent != 0 || tilt.sent != 0)
+    ptz->continuousPanTiltMove(0, 0);
+  pthread_mutex_destroy(&mutex);
+  puts("PtzAxisController: Control loop stopped");
+}
+
+void PtzAxisController::setTarget(float p, float t, int z)
+{
+  double time = now();
+  pthread_mutex_lock(&mutex);
+  bool related = active && time - target_time < TARGET_TIMEOUT;
+  if (!active) {
+    // Take over from whatever the camera was doing
+    pan.integral = tilt.integral = 0;
+    pan.error  = p - pan.estimate;
+    tilt.error = t - tilt.estimate;
+    active = true;
+  }
+  if (related) {
+    // A moving target: follow its speed. Targets can come in bursts (a
+    // client's queue handed over at once), so the speed is only measured
+    // over a control period or more, against the target of back then.
+    double dt = time - reference_time;
+    if (dt >= 1.0 / config.rate) {
+      trackTarget(pan,  p, dt);
+      trackTarget(tilt, t, dt);
+      reference_time = time;
+    }
+  }
+  else {
+    // A new, unrelated target
+    pan.target_speed = tilt.target_speed = 0;
+    pan.reference  = p;
+    tilt.reference = t;
+    reference_time = time;
+  }
+  target_time = time;
+  pan.target  = clamp(p, pan.min,  pan.max);
+  tilt.target = clamp(t, tilt.min, tilt.max);
+  zoom_target = z;
+  pthread_mutex_unlock(&mutex);
+}
+
+void PtzAxisController::trackTarget(axis& a, double target, double dt)
+{
+  // Smoothed over a couple of estimates, and never faster than the camera
+  double speed = 0.5 * a.target_speed + 0.5 * (target - a.reference) / dt;
+  a.target_speed = clamp(speed, -config.max_speed, config.max_speed);
+  a.reference    = target;
+}
+
+void PtzAxisController::release()
+{
+  // Stop the camera before returning: left to the next tick, the stop
+  // would cancel the velocity command the client sends right after
+  pthread_mutex_lock(&mutex);
+  active = false;
+  pan.velocity = tilt.velocity = 0;
+  bool moving = pan.sent != 0 || tilt.sent != 0;
+  pan.sent = tilt.sent = 0;
+  pthread_mutex_unlock(&mutex);
+  if (moving)
+    ptz->continuousPanTiltMove(0, 0);
+}
+
+ptz_state PtzAxisController::pose()
+{
+  ptz_state s;
+  pthread_mutex_lock(&mutex);
+  s.pan  = pan.estimate;
+  s.tilt = tilt.estimate;
+  s.zoom = zoom;
+  pthread_mutex_unlock(&mutex);
+  return s;
+}
+
+void* PtzAxisController::start_control_thread(void* ptr)
+{
+  ((PtzAxisController*)ptr)->control();
+  return NULL;
+}
+
+double PtzAxisController::step(axis& a, double dt, bool moving, double since)
+{
+  // A moving target has moved on since it was set, but not off the range
+  double target = moving ? clamp(a.target + a.target_speed * since, a.min, a.max) : a.target;
+  double error = target - a.estimate;
+  double derivative = (error - a.error) / dt;
+  double feedforward = moving ? config.kf * a.target_speed : 0;
+  a.error = error;
+
+  if (fabs(error) < config.deadband && fabs(feedforward) < config.deadband) {
+    a.integral = 0;
+    a.velocity = 0;
+    return 0;
+  }
+
+  double v = feedforward + config.kp * error + config.ki * a.integral + config.kd * derivative;
+
+  // Trapezoidal profile: never faster than the limit, nor than what can
+  // still be stopped within the remaining error (plus the target's own speed)
+  double vmax = fmin(config.max_speed,
+		     sqrt(2 * config.max_accel * fabs(error)) + fabs(feedforward));
+  if (fabs(v) < vmax)
+    a.integral += error * dt;          // No windup while saturated
+  v = clamp(v, -vmax, vmax);
+
+  // Accelerate at most max_accel
+  double dv = config.max_accel * dt;
+  a.velocity = clamp(v, a.velocity - dv, a.velocity + dv);
+  return a.velocity;
+}
+
+int PtzAxisController::quantize(double velocity)
+{
+  if (velocity == 0)
+    return 0;
+  int speed = (int)lround(velocity / config.speed_scale * 100);
+  // A slow but non zero velocity still has to move the camera
+  if (speed == 0)
+    speed = velocity > 0 ? 1 : -1;
+  return (int)clamp(speed, -100, 100);
+}
+
+void PtzAxisController::pollDone(void* data, bool ok, const std::string& reply)
+{
+  PtzAxisController* c = (PtzAxisController*)data;
+  ptz_state s;
+  if (ok && PtzAxisDevice::parseState(reply, s)) {
+    pthread_mutex_lock(&c->mutex);
+    // The camera was there about half a round trip ago
+    double age = (now() - c->poll_sent) / 2;
+    c->pan.estimate  = s.pan  + c->pan.sent  * c->config.speed_scale / 100 * age;
+    c->tilt.estimate = s.tilt + c->tilt.sent * c->config.speed_scale / 100 * age;
+    c->zoom          = s.zoom;
+    pthread_mutex_unlock(&c->mutex);
+  }
+  c->polling = false;
+}
+
+void PtzAxisController::control()
+{
+  double period      = 1.0 / config.rate;
+  double poll_period = 1.0 / config.poll_rate;
+  double last        = now();
+  double next        = last;
+  double next_poll   = last;
+
+  while (running) {
+    double t  = now();
+    double dt = t - last;
+    last = t;
+
+    // Estimate the pose from what the camera was told to do...
+    pthread_mutex_lock(&mutex);
+    pan.estimate  += pan.sent  * config.speed_scale / 100 * dt;
+    tilt.estimate += tilt.sent * config.speed_scale / 100 * dt;
+    pthread_mutex_unlock(&mutex);
+
+    // ...and correct it with the real one now and then. Neither the
+    // queries nor the commands are waited for: a round trip to the camera
+    // must not stretch the period of the loop.
+    if (t >= next_poll && !polling) {
+      next_poll += poll_period;
+      if (next_poll < t)
+	next_poll = t + poll_period;
+      pthread_mutex_lock(&mutex);
+      poll_sent = t;
+      pthread_mutex_unlock(&mutex);
+      polling = true;
+      ptz->queryState(&PtzAxisController::pollDone, this);
+    }
+
+    pthread_mutex_lock(&mutex);
+    int p = 0, s = 0;
+    if (active) {
+      // A target that stopped coming is a target that stopped moving
+      bool moving = t - target_time < TARGET_TIMEOUT;
+      p = quantize(step(pan,  dt > 0 ? dt : period, moving, t - target_time));
+      s = quantize(step(tilt, dt > 0 ? dt : period, moving, t - target_time));
+    }
+    else
+      pan.velocity = tilt.velocity = 0;
+
+    // Only talk to the camera when the speeds change. Queued with the
+    // mutex held, so release() cannot slip its stop in before them.
+    if (p != pan.sent || s != tilt.sent) {
+      ptz->continuousPanTiltMove(p, s, false);
+      pan.sent  = p;
+      tilt.sent = s;
+      commands++;
+    }
+    if (active && zoom_target != zoom_sent) {
+      ptz->zoom(zoom_target, false);
+      zoom_sent = zoom_target;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    next += period;
+    double wait = next - now();
+    if (wait > 0)
+      usleep((useconds_t)(wait * 1e6));
+    else
+      next = now();            // Overrun, do not try to catch up
+  }
+}
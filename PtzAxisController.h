@@ -0,0 +1,105 @@
+/****************************************************************************\
+ *  PtzAxis version 0.1a                                                    *
+ *  A PTZ Plugin Driver for the Player/Stage robot server                   *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  Closed-loop position controller of the Axis 214 PTZ head: follows      *
+ *  pan/tilt targets with continuous moves from a PID loop shaped by a      *
+ *  trapezoidal (speed and acceleration limited) profile, so targets can    *
+ *  change at any time instead of waiting for an absolute move to finish.   *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#ifndef PTZ_AXIS_CONTROLLER_H
+#define PTZ_AXIS_CONTROLLER_H
+
+#include <pthread.h>
+
+#include "PtzAxisDevice.h"
+
+// Tuning of the controller, see PtzAxisController::defaults()
+typedef struct _ptz_controller_config {
+  double rate;             // Hz of the control loop
+  double poll_rate;        // Hz of the position queries, the pose is estimated in between
+  double kp, ki, kd;       // PID gains: degree/s per degree of error
+  double kf;               // Feedforward of the speed of the target, 0 for none
+  double max_speed;        // Limit of the commanded speed, degree/s
+  double max_accel;        // Limit of the commanded acceleration, degree/s^2
+  double speed_scale;      // Speed of the camera at continuous move speed 100, degree/s
+  double deadband;         // Error below which an axis is stopped, degree
+  double pan_min, pan_max;   // Range of the head, the targets are kept within, degree
+  double tilt_min, tilt_max;
+} ptz_controller_config;
+
+class PtzAxisController
+{
+public:
+  // Starts the control loop, idle until the first target
+  PtzAxisController(PtzAxisDevice* ptz, const ptz_controller_config& config);
+  // Stops the camera and the control loop
+  ~PtzAxisController();
+
+  static ptz_controller_config defaults();
+
+  // New position target, takes effect on the next tick of the loop
+  void      setTarget(float pan, float tilt, int zoom);
+  // Stop controlling (e.g. in velocity mode), the pose is still polled.
+  // Returns once the camera has been told to stop.
+  void      release();
+  // Estimated pose of the camera
+  ptz_state pose();
+  // Continuous moves sent so far
+  unsigned long commandsSent() { return commands; }
+
+private:
+  // One axis of the loop
+  typedef struct _axis {
+    double target;         // degree
+    double target_speed;   // Estimated from the last targets, degree/s
+    double reference;      // Target the speed was last estimated from, degree
+    double estimate;       // degree
+    double velocity;       // Commanded, degree/s
+    double integral;       // Of the error, degree*s
+    double error;          // Of the previous tick, degree
+    int    sent;           // Last speed sent to the camera, -100..100
+    double min, max;       // Range, degree
+  } axis;
+
+  static void* start_control_thread(void* ptr);
+  void   control();
+  // Completion of the position queries, folded into the estimate
+  static void pollDone(void* data, bool ok, const std::string& reply);
+  // Velocity for one axis after one tick of dt seconds, "since" seconds
+  // after the last target
+  double step(axis& a, double dt, bool moving, double since);
+  // Speed of the target of one axis, "dt" seconds after its reference
+  void   trackTarget(axis& a, double target, double dt);
+  // Speed in camera units of a velocity
+  int    quantize(double velocity);
+
+  PtzAxisDevice*        ptz;
+  ptz_controller_config config;
+  pthread_t             control_thread;
+  pthread_mutex_t       mutex;      // Protects the targets, the estimate and the speeds sent
+  volatile bool         running;
+  volatile bool         polling;    // A position query is on its way
+  double                poll_sent;  // When it left
+
+  bool   active;           // Following a target
+  double target_time;      // When the last target came
+  double reference_time;   // When the target speeds were last estimated
+  axis   pan, tilt;
+  int    zoom_target;      // Zoom is sent as an absolute zoom when it changes
+  int    zoom_sent;
+  int    zoom;             // Polled zoom
+  unsigned long commands;
+};
+
+#endif
@@ -0,0 +1,137 @@
+/****************************************************************************\
+ *  PtzAxis version 0.1a                                                    *
+ *  A PTZ Plugin Driver for the Player/Stage robot server                   *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  The PTZ device of the Axis 214, see PtzAxisDevice.h                     *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PtzAxisDevice.h"
+
+using std::string;
+
+PtzAxisDevice::PtzAxisDevice(string ip)
+{
+  puts("PtzAxisDevice: Start device");
+  ptz_ip = ip;
+  ptz_cmd_prefix = ptz_ip + "/axis-cgi/com/ptz.cgi?";
+  state.pan  = 0;
+  state.tilt = 0;
+  state.zoom = 0;
+  verbose = true;
+  reactor = AxisReactor::acquire();
+}
+
+PtzAxisDevice::~PtzAxisDevice()
+{
+  AxisReactor::release();
+  puts("PtzAxisDevice: Device closed");
+}
+
+bool PtzAxisDevice::sendCommand(const char* suffix, int n, bool wait, int kind)
+{
+  string ptz_cmd = ptz_cmd_prefix;
+  ptz_cmd.append(suffix, n);
+
+  if (verbose) {
+    puts("command:");
+    puts(ptz_cmd.c_str());
+  }
+
+  if (wait)
+    return reactor->perform(&cmd_lane, ptz_cmd, NULL, kind);
+  reactor->submit(&cmd_lane, ptz_cmd, &PtzAxisDevice::commandDone, NULL, kind);
+  return true;
+}
+
+void PtzAxisDevice::commandDone(void*, bool ok, const string& reply)
+{
+  if (!ok && reply != AXIS_REACTOR_SUPERSEDED)
+    puts("PtzAxisDevice: command failed");
+}
+
+bool PtzAxisDevice::move(float pan, float tilt, int speed, bool wait)
+{
+  // Move the camera to a specified PT position
+  char   ptz_cmd_suffix[64];
+  int n = sprintf(ptz_cmd_suffix, "pan=%.1f&tilt=%.1f&speed=%d&autofocus=on",
+		  pan, tilt, speed);
+  return sendCommand(ptz_cmd_suffix, n, wait, PTZ_CMD_MOTION);
+}
+
+//
+// Execute a continuous pan/tilt/zoom move.  The three inputs are
+// assumed to be speeds, the combination of which constitute the
+// vector in which the camera is moving in p/t/z.
+//
+bool PtzAxisDevice::continuousMove(int pan, int tilt, int zoom, bool wait)
+{
+  char   ptz_cmd_suffix[64];
+  int n = sprintf(ptz_cmd_suffix, "continuouspantiltmove=%d,%d&continuouszoommove=%d", pan, tilt, zoom);
+  return sendCommand(ptz_cmd_suffix, n, wait, PTZ_CMD_MOTION);
+}
+
+bool PtzAxisDevice::continuousPanTiltMove(int pan, int tilt, bool wait)
+{
+  // Without continuouszoommove, which would stop a zoom in progress
+  char   ptz_cmd_suffix[64];
+  int n = sprintf(ptz_cmd_suffix, "continuouspantiltmove=%d,%d", pan, tilt);
+  return sendCommand(ptz_cmd_suffix, n, wait, PTZ_CMD_MOTION);
+}
+
+bool PtzAxisDevice::zoom(int zoom, bool wait)
+{
+  // Zoom the camera to a specified value
+  char   ptz_cmd_suffix[64];
+  int n = sprintf(ptz_cmd_suffix, "zoom=%d&autofocus=on", zoom);
+  return sendCommand(ptz_cmd_suffix, n, wait, PTZ_CMD_ZOOM);
+}
+
+bool PtzAxisDevice::updateState()
+{
+  string reply;
+  if (!reactor->perform(&query_lane, ptz_cmd_prefix + "query=position", &reply))
+    return false;
+  return stateParser(reply);
+}
+
+void PtzAxisDevice::queryState(AxisReactor::completion done, void* data)
+{
+  reactor->submit(&query_lane, ptz_cmd_prefix + "query=position", done, data);
+}
+
+bool PtzAxisDevice::stateParser(const string& reply)
+{
+  return parseState(reply, state);
+}
+
+bool PtzAxisDevice::parseState(const string& reply, ptz_state& state)
+{
+  // The reply is a list of "key=value" lines: pan=12.34\ntilt=-5.00\nzoom=1\n...
+  const char* text = reply.c_str();
+  const char* pan  = strstr(text, "pan=");
+  const char* tilt = strstr(text, "tilt=");
+  const char* zoom = strstr(text, "zoom=");
+
+  if (strstr(text, "Error") || !pan || !tilt || !zoom) {
+    puts("error");
+    return false;
+  }
+
+  state.pan  = atof(pan + 4);
+  state.tilt = atof(tilt + 5);
+  state.zoom = atoi(zoom + 5);
+  return true;
+}
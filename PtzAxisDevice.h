@@ -0,0 +1,87 @@
+/****************************************************************************\
+ *  PtzAxis version 0.1a                                                    *
+ *  A PTZ Plugin Driver for the Player/Stage robot server                   *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  The PTZ device of the Axis 214: wraps the ptz.cgi commands and the      *
+ *  position query. Kept free of Player so it can also be linked into the   *
+ *  load test (see AxisLoad.cc).                                            *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#ifndef PTZ_AXIS_DEVICE_H
+#define PTZ_AXIS_DEVICE_H
+
+#include <stddef.h>
+#include <string>
+
+#include "AxisReactor.h"
+
+typedef struct _ptz_state {
+  float pan;               // degree
+  float tilt;              // degree
+  int   zoom;              // device specified
+} ptz_state;
+
+// Kinds of commands: a newer command replaces the one of its kind still
+// queued for the camera, see AxisReactor::submit()
+enum { PTZ_CMD_MOTION = 1, PTZ_CMD_ZOOM = 2 };
+
+// Class of the PTZ device
+class PtzAxisDevice
+{
+public:
+  PtzAxisDevice(std::string);
+  ~PtzAxisDevice();
+
+  // Interface for controling, all return true when the camera answered.
+  // With wait false they return once queued, failures are only printed;
+  // commands of one device still reach the camera in order, a move (or a
+  // zoom) still waiting for the camera being dropped for a newer one.
+  bool move(float pan, float tilt, int speed, bool wait = true);       // Absolute position move
+  bool continuousMove(int pan, int tilt, int speed, bool wait = true); // Continuous move
+  bool continuousPanTiltMove(int pan, int tilt, bool wait = true);     // Continuous move, zoom untouched
+  bool zoom(int zoom, bool wait = true);                               // Absolute zoom
+
+  // Interface for querying
+  bool updateState();                            // Update the ptz_state of the device
+  ptz_state state;                               // The ptz_state of the device
+
+  // Query the position without waiting: "done" gets the answer on the I/O
+  // thread, to be read with parseState(); "state" is left alone
+  void queryState(AxisReactor::completion done, void* data);
+  static bool parseState(const std::string& reply, ptz_state& state);
+
+  bool verbose;                                  // Print every command sent (default)
+
+protected:
+  // Send "ptz_cmd_prefix + suffix" to the camera, ignoring the answer
+  bool sendCommand(const char* suffix, int n, bool wait, int kind);
+  // Completion of the commands nobody waits for
+  static void commandDone(void *data, bool ok, const std::string& reply);
+
+  // Tool function of updateState, parseState() into "state"
+  bool stateParser(const std::string& reply);
+
+  // Shared I/O thread: commands go in the lane "&cmd_lane", queries in
+  // the lane "&query_lane", so polling does not wait behind queued
+  // commands. Members of their own: "this" and "&state" are one address.
+  AxisReactor* reactor;
+  char         cmd_lane;
+  char         query_lane;
+
+  // Internal data
+  std::string ptz_ip;                            // Ip of the camera
+  std::string ptz_cmd_prefix;                    // For wrapping command
+  // Fans commands out to its members through their lanes, see PtzAxisGroup.h
+  friend class PtzAxisGroup;
+};
+
+#endif
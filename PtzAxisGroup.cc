@@ -0,0 +1,367 @@
+/****************************************************************************\
+ *  PtzAxis version 0.1a                                                    *
+ *  A PTZ Plugin Driver for the Player/Stage robot server                   *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  A group of Axis 214 PTZ heads moved as one, see PtzAxisGroup.h          *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "PtzAxisGroup.h"
+
+#define RTT_SMOOTHING     0.2          // Weight of a new round trip sample
+#define WARM_INTERVAL_SEC 20           // Idle command connections are used again after this
+
+using std::string;
+using std::vector;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// A request of a batch, to be filled by the reactor
+static AxisReactor::batch_request request(const void* lane, const string& url, double delay,
+					  int kind = 0)
+{
+  AxisReactor::batch_request r;
+  r.lane     = lane;
+  r.url      = url;
+  r.kind     = kind;
+  r.delay    = delay;
+  r.ok       = false;
+  r.sent     = 0;
+  r.answered = 0;
+  return r;
+}
+
+PtzAxisGroup::PtzAxisGroup(const vector<string>& ips)
+{
+  printf("PtzAxisGroup: Start group of %d cameras\n", (int)ips.size());
+  for (size_t i = 0; i < ips.size(); i++) {
+    members.push_back(new PtzAxisDevice(ips[i]));
+    members.back()->verbose = false;   // The group prints its commands once
+  }
+  reactor = AxisReactor::acquire();
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&idle, NULL);
+  pending      = 0;
+  polls        = 0;
+  rtt.assign(members.size(), -1);
+  polling.assign(members.size(), false);
+  answered.assign(members.size(), true);
+  polled.resize(members.size());
+  last_command = 0;
+  commands     = 0;
+  align        = true;
+  verbose      = true;
+}
+
+PtzAxisGroup::~PtzAxisGroup()
+{
+  // The reactor still holds "this" for the commands and polls in flight
+  pthread_mutex_lock(&mutex);
+  while (pending > 0 || polls > 0)
+    pthread_cond_wait(&idle, &mutex);
+  pthread_mutex_unlock(&mutex);
+
+  for (size_t i = 0; i < members.size(); i++)
+    delete members[i];
+  AxisReactor::release();
+  pthread_cond_destroy(&idle);
+  pthread_mutex_destroy(&mutex);
+  puts("PtzAxisGroup: Group closed");
+}
+
+bool PtzAxisGroup::warmUp()
+{
+  // A query in both lanes of every camera: one connection for the commands
+  // and one for the queries, both kept alive by the reactor afterwards
+  vector<AxisReactor::batch_request> requests;
+  for (size_t i = 0; i < members.size(); i++)
+    requests.push_back(request(&members[i]->query_lane,
+			       members[i]->ptz_cmd_prefix + "query=position", 0));
+  for (size_t i = 0; i < members.size(); i++)
+    requests.push_back(request(&members[i]->cmd_lane,
+			       members[i]->ptz_cmd_prefix + "query=position", 0));
+
+  bool ok = reactor->performBatch(requests);
+  record(requests, true);
+  pthread_mutex_lock(&mutex);
+  last_command = now();
+  pthread_mutex_unlock(&mutex);
+
+  for (size_t i = 0; i < members.size(); i++) {
+    bool up = requests[i].ok && members[i]->stateParser(requests[i].body);
+    if (up)
+      printf("PtzAxisGroup: camera %d ready, round trip %.1f ms\n", (int)i, rtt[i] * 1000);
+    else {
+      printf("PtzAxisGroup: camera %d NOT ANSWERING\n", (int)i);
+      ok = false;
+    }
+    pthread_mutex_lock(&mutex);
+    answered[i] = up;
+    polled[i]   = members[i]->state;
+    pthread_mutex_unlock(&mutex);
+  }
+  return ok;
+}
+
+PtzAxisGroup::part PtzAxisGroup::movePart(float pan, float tilt, int speed)
+{
+  char   ptz_cmd_suffix[64];
+  int n = sprintf(ptz_cmd_suffix, "pan=%.1f&tilt=%.1f&speed=%d&autofocus=on",
+		  pan, tilt, speed);
+  part p = {string(ptz_cmd_suffix, n), PTZ_CMD_MOTION, vector<bool>(members.size(), true)};
+  return p;
+}
+
+PtzAxisGroup::part PtzAxisGroup::zoomPart(int zoom)
+{
+  char   ptz_cmd_suffix[64];
+  int n = sprintf(ptz_cmd_suffix, "zoom=%d&autofocus=on", zoom);
+
+  // A zoom blocks the camera's other moves: leave alone the cameras that
+  // are there already, as polled by the last updateState()
+  part p = {string(ptz_cmd_suffix, n), PTZ_CMD_ZOOM, vector<bool>(members.size())};
+  for (size_t i = 0; i < members.size(); i++)
+    p.to[i] = members[i]->state.zoom != zoom;
+  return p;
+}
+
+bool PtzAxisGroup::move(float pan, float tilt, int speed, bool wait)
+{
+  return fanOut(vector<part>(1, movePart(pan, tilt, speed)), wait);
+}
+
+bool PtzAxisGroup::continuousMove(int pan, int tilt, int zoom, bool wait)
+{
+  char   ptz_cmd_suffix[64];
+  int n = sprintf(ptz_cmd_suffix, "continuouspantiltmove=%d,%d&continuouszoommove=%d", pan, tilt, zoom);
+  part p = {string(ptz_cmd_suffix, n), PTZ_CMD_MOTION, vector<bool>(members.size(), true)};
+  return fanOut(vector<part>(1, p), wait);
+}
+
+bool PtzAxisGroup::zoom(int zoom, bool wait)
+{
+  return fanOut(vector<part>(1, zoomPart(zoom)), wait);
+}
+
+bool PtzAxisGroup::position(float pan, float tilt, int speed, int zoom, bool wait)
+{
+  // One batch: each camera gets its zoom first, in the same lane
+  vector<part> parts;
+  parts.push_back(zoomPart(zoom));
+  parts.push_back(movePart(pan, tilt, speed));
+  return fanOut(parts, wait);
+}
+
+bool PtzAxisGroup::fanOut(const vector<part>& parts, bool wait)
+{
+  bool any = false;
+  for (size_t k = 0; k < parts.size(); k++)
+    any = any || std::find(parts[k].to.begin(), parts[k].to.end(), true) != parts[k].to.end();
+  if (!any)
+    return true;
+
+  if (verbose)
+    for (size_t k = 0; k < parts.size(); k++)
+      if (std::find(parts[k].to.begin(), parts[k].to.end(), true) != parts[k].to.end())
+	printf("group command:\n%s\n", parts[k].suffix.c_str());
+
+  // A command reaches its camera half a round trip after it left: hold
+  // back the nearer cameras so they all get it when the farthest does
+  vector<AxisReactor::batch_request> requests;
+  pthread_mutex_lock(&mutex);
+  double slowest = 0;
+  for (size_t k = 0; k < parts.size(); k++)
+    for (size_t i = 0; i < members.size(); i++)
+      if (parts[k].to[i] && rtt[i] > slowest)
+	slowest = rtt[i];
+  for (size_t k = 0; k < parts.size(); k++)
+    for (size_t i = 0; i < members.size(); i++) {
+      if (!parts[k].to[i])
+	continue;
+      double delay = (align && rtt[i] >= 0) ? (slowest - rtt[i]) / 2 : 0;
+      requests.push_back(request(&members[i]->cmd_lane,
+				 members[i]->ptz_cmd_prefix + parts[k].suffix, delay, parts[k].kind));
+    }
+  last_command = now();
+  commands++;
+  if (!wait)
+    pending++;
+  pthread_mutex_unlock(&mutex);
+
+  if (!wait) {
+    reactor->submitBatch(requests, &PtzAxisGroup::commandDone, this);
+    return true;
+  }
+  bool ok = reactor->performBatch(requests);
+  record(requests, false);
+  return ok;
+}
+
+void PtzAxisGroup::commandDone(void* data, vector<AxisReactor::batch_request>& requests)
+{
+  PtzAxisGroup* group = (PtzAxisGroup*)data;
+  group->record(requests, false);
+  pthread_mutex_lock(&group->mutex);
+  if (--group->pending == 0 && group->polls == 0)
+    pthread_cond_signal(&group->idle);
+  pthread_mutex_unlock(&group->mutex);
+}
+
+bool PtzAxisGroup::updateState()
+{
+  // One query at a time per camera, each one on its own: a batch would
+  // hold the answers of all the cameras until the slowest one
+  vector<size_t> idle_members;
+  bool ok = true;
+  pthread_mutex_lock(&mutex);
+  for (size_t i = 0; i < members.size(); i++) {
+    members[i]->state = polled[i];
+    ok = ok && answered[i];
+    if (!polling[i]) {
+      polling[i] = true;
+      idle_members.push_back(i);
+    }
+  }
+
+  // Without commands for a while the cameras may close the command
+  // connections: query over them too so the next command finds them open
+  bool rewarm = pending == 0 && now() - last_command > WARM_INTERVAL_SEC;
+  if (rewarm)
+    last_command = now();
+  polls += idle_members.size() + (rewarm ? members.size() : 0);
+  pthread_mutex_unlock(&mutex);
+
+  for (size_t k = 0; k < idle_members.size(); k++) {
+    PtzAxisDevice* m = members[idle_members[k]];
+    vector<AxisReactor::batch_request> query(1, request(&m->query_lane,
+							  m->ptz_cmd_prefix + "query=position", 0));
+    reactor->submitBatch(query, &PtzAxisGroup::pollDone, this);
+  }
+  if (rewarm)
+    for (size_t i = 0; i < members.size(); i++) {
+      vector<AxisReactor::batch_request> query(1, request(&members[i]->cmd_lane,
+							    members[i]->ptz_cmd_prefix + "query=position", 0));
+      reactor->submitBatch(query, &PtzAxisGroup::pollDone, this);
+    }
+  return ok;
+}
+
+void PtzAxisGroup::pollDone(void* data, vector<AxisReactor::batch_request>& requests)
+{
+  PtzAxisGroup* group = (PtzAxisGroup*)data;
+  group->record(requests, true);
+
+  AxisReactor::batch_request& r = requests[0];
+  size_t m = group->memberOf(r.lane);
+  ptz_state s;
+  bool up = r.ok && PtzAxisDevice::parseState(r.body, s);
+
+  pthread_mutex_lock(&group->mutex);
+  if (r.lane == &group->members[m]->query_lane) {
+    if (up != group->answered[m])
+      printf("PtzAxisGroup: camera %d %s\n", (int)m, up ? "answering again" : "NOT ANSWERING");
+    if (up)
+      group->polled[m] = s;
+    group->answered[m] = up;
+    group->polling[m]  = false;
+  }
+  if (--group->polls == 0 && group->pending == 0)
+    pthread_cond_signal(&group->idle);
+  pthread_mutex_unlock(&group->mutex);
+}
+
+bool PtzAxisGroup::answering(size_t i)
+{
+  pthread_mutex_lock(&mutex);
+  bool up = answered[i];
+  pthread_mutex_unlock(&mutex);
+  return up;
+}
+
+double PtzAxisGroup::roundTrip(size_t i)
+{
+  pthread_mutex_lock(&mutex);
+  double r = rtt[i];
+  pthread_mutex_unlock(&mutex);
+  return r;
+}
+
+void PtzAxisGroup::record(vector<AxisReactor::batch_request>& requests, bool queries)
+{
+  pthread_mutex_lock(&mutex);
+  if (queries) {
+    // Queries measure the round trips, the cameras answer them at once
+    for (size_t i = 0; i < requests.size(); i++) {
+      size_t m = memberOf(requests[i].lane);
+      if (!requests[i].ok)
+	continue;
+      double sample = requests[i].answered - requests[i].sent;
+      rtt[m] = rtt[m] < 0 ? sample : (1 - RTT_SMOOTHING) * rtt[m] + RTT_SMOOTHING * sample;
+    }
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+
+  // Cameras the command was not for are done already; the others are done
+  // when all their requests are, from the first sent to the last answered
+  ptz_result skipped = {true, 0, 0};
+  last.assign(members.size(), skipped);
+  vector<bool> seen(members.size(), false);
+  for (size_t i = 0; i < requests.size(); i++) {
+    size_t m = memberOf(requests[i].lane);
+    if (!seen[m]) {
+      last[m].ok       = requests[i].ok;
+      last[m].sent     = requests[i].sent;
+      last[m].answered = requests[i].answered;
+      seen[m] = true;
+      continue;
+    }
+    last[m].ok       = last[m].ok && requests[i].ok;
+    last[m].sent     = std::min(last[m].sent, requests[i].sent);
+    last[m].answered = std::max(last[m].answered, requests[i].answered);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  for (size_t i = 0; i < requests.size(); i++) {
+    bool superseded = requests[i].body == AXIS_REACTOR_SUPERSEDED;
+    if (verbose || (!requests[i].ok && !superseded))
+      printf("PtzAxisGroup: camera %d %s, sent at %.1f ms, answered at %.1f ms\n",
+	     (int)memberOf(requests[i].lane),
+	     requests[i].ok ? "done" : (superseded ? "superseded" : "FAILED"),
+	     requests[i].sent * 1000, requests[i].answered * 1000);
+  }
+}
+
+size_t PtzAxisGroup::memberOf(const void* lane)
+{
+  for (size_t i = 0; i < members.size(); i++)
+    if (lane == &members[i]->cmd_lane || lane == &members[i]->query_lane)
+      return i;
+  return 0;
+}
+
+vector<ptz_result> PtzAxisGroup::results()
+{
+  pthread_mutex_lock(&mutex);
+  vector<ptz_result> r = last;
+  pthread_mutex_unlock(&mutex);
+  return r;
+}
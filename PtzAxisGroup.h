@@ -0,0 +1,118 @@
+/****************************************************************************\
+ *  PtzAxis version 0.1a                                                    *
+ *  A PTZ Plugin Driver for the Player/Stage robot server                   *
+ *                                                                          *
+ *  Copyright (C) 2010 Zhanwu Xiong                                         *
+ *  zhanwu at cvc dot uab dot es     http://cvc.uab.es/~zhanwu              *
+ *                                                                          *
+ *  A group of Axis 214 PTZ heads moved as one: every group command goes to *
+ *  all the cameras at once, over connections opened beforehand, each one  *
+ *  held back by half the difference of the round trips so the commands    *
+ *  reach the cameras together. The answer of every camera is reported.    *
+ *                                                                          *
+ *  This program is free software; you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation; either version 2 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+\****************************************************************************/
+
+#ifndef PTZ_AXIS_GROUP_H
+#define PTZ_AXIS_GROUP_H
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#include "PtzAxisDevice.h"
+
+// Outcome of a group command on one camera
+typedef struct _ptz_result {
+  bool   ok;               // The camera answered with a success code
+  double sent;             // s after the group command, when it left for this camera
+  double answered;         // s after the group command, when the camera answered
+} ptz_result;
+
+// Class of a group of PTZ devices
+class PtzAxisGroup
+{
+public:
+  PtzAxisGroup(const std::vector<std::string>& ips);
+  // Waits for the commands still running
+  ~PtzAxisGroup();
+
+  size_t         size() { return members.size(); }
+  PtzAxisDevice* member(size_t i) { return members[i]; }
+
+  // Open the connections of every camera, measure their round trips and
+  // update their ptz_state, true if all the cameras answered
+  bool warmUp();
+
+  // Interface for controling, as PtzAxisDevice's but for all the cameras.
+  // They return true when all the cameras answered; with wait false they
+  // return once queued and the answers only show in results().
+  bool move(float pan, float tilt, int speed, bool wait = true);
+  bool continuousMove(int pan, int tilt, int speed, bool wait = true);
+  bool zoom(int zoom, bool wait = true);   // Only to the cameras at another zoom
+  // zoom() then move() as one group command, with one result per camera
+  bool position(float pan, float tilt, int speed, int zoom, bool wait = true);
+
+  // Update the ptz_state of every member with the answers polled so far
+  // and poll again the cameras that answered, without waiting: a camera
+  // that does not answer only delays its own state. True if all the
+  // cameras answered their last poll.
+  bool updateState();
+  // The camera answered its last poll
+  bool answering(size_t i);
+  // Smoothed round trip to a camera, s, negative before the first answer
+  double roundTrip(size_t i);
+
+  // Per camera outcome of the last group command that completed; a camera
+  // the command was not sent to (zoom() leaves the ones already there)
+  // reports ok, sent and answered 0. For a position() the camera is ok
+  // when both its zoom and its move were, from the first sent to the
+  // last answered.
+  std::vector<ptz_result> results();
+  // Group commands sent so far
+  unsigned long commandsSent() { return commands; }
+
+  bool align;              // Hold back the faster cameras (default)
+  bool verbose;            // Print every command and its outcome (default)
+
+private:
+  // One command of a group command: "suffix" to the members marked in "to"
+  typedef struct _part {
+    std::string       suffix;
+    int               kind;
+    std::vector<bool> to;
+  } part;
+
+  // Send the parts, in order, as one group command
+  bool   fanOut(const std::vector<part>& parts, bool wait);
+  // The parts of the group commands
+  part   movePart(float pan, float tilt, int speed);
+  part   zoomPart(int zoom);
+  // Member of a lane of the batches
+  size_t memberOf(const void* lane);
+  // Store the outcome of a batch, on whichever thread has it
+  void   record(std::vector<AxisReactor::batch_request>& requests, bool queries);
+  static void commandDone(void* data, std::vector<AxisReactor::batch_request>& requests);
+  static void pollDone(void* data, std::vector<AxisReactor::batch_request>& requests);
+
+  std::vector<PtzAxisDevice*> members;
+  AxisReactor*     reactor;
+
+  pthread_mutex_t  mutex;           // Protects the following
+  pthread_cond_t   idle;            // Signals pending or polls reaching 0
+  int              pending;         // Group commands not answered yet
+  int              polls;           // Queries not answered yet
+  std::vector<double>     rtt;      // Smoothed round trip of each camera, s
+  std::vector<bool>       polling;  // A position query of the camera is on its way
+  std::vector<bool>       answered; // See answering()
+  std::vector<ptz_state>  polled;   // Last state answered, copied by updateState()
+  std::vector<ptz_result> last;     // See results()
+  double           last_command;    // When the command connections were last used
+  unsigned long    commands;
+};
+
+#endif